@@ -0,0 +1,74 @@
+#ifndef INK_SHM_H
+#define INK_SHM_H
+
+/* Layout of the shared memory segment written by ink_shm().
+ *
+ * The segment starts with an InkShmHeader followed (at data_offset) by
+ * n_slots canvases of slot_size bytes each. Every canvas holds height rows of
+ * stride bytes with premultiplied 0xAARRGGBB pixels (Blend2D's PRGB32).
+ *
+ * The device draws each page into one slot and then moves on to the next slot
+ * in the ring, never waiting for readers. Each slot is guarded by a sequence
+ * lock: its seq counter is odd while the slot is being drawn and even once the
+ * page in it is complete. To read the newest page without copying, a viewer
+ * calls ink_shm_begin_read(), uses the pixels (e.g. uploads them to a
+ * texture), and then calls ink_shm_end_read(). If the latter returns 0 the
+ * device reused the slot in the meantime and the read must be retried.
+ *
+ * The header only uses fixed size fields and can be included from C and C++.
+ * Counters are accessed with the GCC/Clang __atomic builtins.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INK_SHM_MAGIC 0x534B4E49 /* "INKS" */
+#define INK_SHM_VERSION 1
+#define INK_SHM_MAX_SLOTS 16
+
+typedef struct {
+  uint64_t seq;    /* Odd while the slot is being drawn */
+  uint64_t frame;  /* Number of the page held by the slot (from 1) */
+} InkShmSlot;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;       /* Bytes per row */
+  uint32_t n_slots;
+  uint32_t latest;       /* Slot holding the most recently completed page */
+  uint32_t closed;       /* Set to 1 when the device is closed */
+  uint64_t frame;        /* Number of completed pages. 0 if none yet */
+  uint64_t data_offset;  /* Offset of the first slot from the segment start */
+  uint64_t slot_size;    /* Bytes between the start of consecutive slots */
+  InkShmSlot slots[INK_SHM_MAX_SLOTS];
+} InkShmHeader;
+
+/* Returns the pixels of the newest complete page, or NULL if no page has been
+ * completed or the slot is being drawn to. slot and seq must be passed on to
+ * ink_shm_end_read()
+ */
+static inline const uint8_t* ink_shm_begin_read(const InkShmHeader* header,
+                                                uint32_t* slot,
+                                                uint64_t* seq) {
+  if (__atomic_load_n(&header->frame, __ATOMIC_ACQUIRE) == 0) return NULL;
+  *slot = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+  if (*slot >= header->n_slots) return NULL;
+  *seq = __atomic_load_n(&header->slots[*slot].seq, __ATOMIC_ACQUIRE);
+  if (*seq & 1) return NULL;
+  return (const uint8_t*) header + header->data_offset +
+    header->slot_size * *slot;
+}
+
+/* Returns 1 if the slot was left untouched since ink_shm_begin_read(), i.e.
+ * the pixels read in between form a complete page
+ */
+static inline int ink_shm_end_read(const InkShmHeader* header, uint32_t slot,
+                                   uint64_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&header->slots[slot].seq, __ATOMIC_RELAXED) == seq;
+}
+
+#endif
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelFormat.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Size of the file header and BITMAPV4HEADER
+static const uint32_t BMP_HEADER_SIZE = 14 + 108;
+
+inline void bmp_put_u16(uint8_t* buf, uint16_t value) {
+  buf[0] = value & 0xFF;
+  buf[1] = (value >> 8) & 0xFF;
+}
+inline void bmp_put_u32(uint8_t* buf, uint32_t value) {
+  buf[0] = value & 0xFF;
+  buf[1] = (value >> 8) & 0xFF;
+  buf[2] = (value >> 16) & 0xFF;
+  buf[3] = (value >> 24) & 0xFF;
+}
+
+// Size of a row of pixels in a BMP file, which is padded to 4 bytes
+inline uint64_t bmp_row_bytes(int w, int bytes) {
+  return ((uint64_t) bytes * w + 3) & ~((uint64_t) 3);
+}
+
+/* Fills in the header of a BMP file using a BITMAPV4HEADER. 32-bit files
+ * (bytes = 4) have an alpha channel given by explicit channel masks, while
+ * 24-bit files are plain BGR. The pixel array starts at offset. Top-down files
+ * store the first row first
+ */
+inline void bmp_header(uint8_t* header, int w, int h, bool top_down,
+                       uint32_t ppm, uint32_t offset, int bytes = 4) {
+  uint64_t image_size = bmp_row_bytes(w, bytes) * h;
+  uint8_t* info = header + 14;
+  memset(header, 0, BMP_HEADER_SIZE);
+  header[0] = 'B';
+  header[1] = 'M';
+  bmp_put_u32(header + 2, (uint32_t) (image_size + offset));
+  bmp_put_u32(header + 10, offset);
+  bmp_put_u32(info, 108);
+  bmp_put_u32(info + 4, w);
+  bmp_put_u32(info + 8, top_down ? -h : h);
+  bmp_put_u16(info + 12, 1);    // planes
+  bmp_put_u16(info + 14, 8 * bytes); // bits per pixel
+  bmp_put_u32(info + 16, bytes == 4 ? 3 : 0); // BI_BITFIELDS or BI_RGB
+  bmp_put_u32(info + 20, (uint32_t) image_size);
+  bmp_put_u32(info + 24, ppm);
+  bmp_put_u32(info + 28, ppm);
+  if (bytes == 4) {
+    bmp_put_u32(info + 40, 0x00FF0000); // red mask
+    bmp_put_u32(info + 44, 0x0000FF00); // green mask
+    bmp_put_u32(info + 48, 0x000000FF); // blue mask
+    bmp_put_u32(info + 52, 0xFF000000); // alpha mask
+  }
+  bmp_put_u32(info + 56, 0x73524742); // colour space: 'sRGB'
+}
+
+/* Writer for 32-bit BMP files with an alpha channel, or 24-bit files for
+ * opaque (XRGB32) canvases.
+ *
+ * Pixels are un-premultiplied and stored bottom-up. As all rows have the same
+ * size the file can also be written in bands of rows starting from the top of
+ * the image, by seeking to the position of each band, so that a page never has
+ * to be held in memory in full. Whole pages and banded pages give identical
+ * files.
+ *
+ * The writer keeps its row buffer between pages. It is not thread safe, but
+ * may be used from another thread than the one creating it.
+ */
+class BmpWriter {
+  uint32_t ppm;
+  FILE* file = NULL;
+  int width = 0;
+  int height = 0;
+  int next_row = 0;
+  uint32_t format = BL_FORMAT_PRGB32;
+  std::vector<uint32_t> row;
+
+public:
+  BmpWriter(double res) :
+    ppm((uint32_t) (res / 0.0254 + 0.5))
+  {
+
+  }
+  ~BmpWriter() {
+    if (file != NULL) fclose(file);
+  }
+
+  bool write(const BLImage& image, const char* path) {
+    BLImageData data;
+    if (image.getData(&data) != BL_SUCCESS) {
+      return false;
+    }
+    bool success = begin(path, data.size.w, data.size.h, data.format) &&
+      write_rows(image, data.size.h);
+    return end() && success;
+  }
+
+  // Opens the file and writes the header for an image of w x h pixels drawn
+  // on a canvas of the given pixel format
+  bool begin(const char* path, int w, int h,
+             uint32_t canvas_format = BL_FORMAT_PRGB32) {
+    if (file != NULL) end();
+    file = fopen(path, "wb");
+    if (file == NULL) {
+      return false;
+    }
+    width = w;
+    height = h;
+    next_row = 0;
+    format = canvas_format;
+
+    uint8_t header[BMP_HEADER_SIZE];
+    bmp_header(header, w, h, false, ppm, BMP_HEADER_SIZE,
+               file_bytes(format));
+    return fwrite(header, 1, BMP_HEADER_SIZE, file) == BMP_HEADER_SIZE;
+  }
+
+  // Writes the first rows of image as the next rows of the file
+  bool write_rows(const BLImage& image, int rows) {
+    if (file == NULL) return false;
+    BLImageData data;
+    if (image.getData(&data) != BL_SUCCESS || data.size.w != width ||
+        data.format != format) {
+      return false;
+    }
+    rows = rows > height - next_row ? height - next_row : rows;
+    if (rows <= 0) return true;
+
+    // The last row of the band comes first in the file
+    int64_t offset = BMP_HEADER_SIZE +
+      (int64_t) row_bytes() * (height - next_row - rows);
+    if (!seek(offset)) return false;
+
+    bool success = format == BL_FORMAT_XRGB32 ?
+      write_band<BL_FORMAT_XRGB32>(data, rows) :
+      write_band<BL_FORMAT_PRGB32>(data, rows);
+    next_row += rows;
+    return success;
+  }
+
+  // Closes the file. Returns false if not all rows were written
+  bool end() {
+    if (file == NULL) return false;
+    bool success = fclose(file) == 0 && next_row == height;
+    file = NULL;
+    return success;
+  }
+
+private:
+  uint64_t row_bytes() const {
+    return bmp_row_bytes(width, file_bytes(format));
+  }
+
+  template<uint32_t Format>
+  bool write_band(const BLImageData& data, int rows) {
+    // Zero initialised so the padding of 24-bit rows is written as zeros
+    row.resize((row_bytes() + 3) / 4);
+    const uint8_t* pixels = (const uint8_t*) data.pixelData;
+    size_t bytes = row_bytes();
+    for (int y = rows - 1; y >= 0; --y) {
+      PixelFormat<Format>::to_bgr((uint8_t*) row.data(),
+                                  (const uint32_t*) (pixels + data.stride * y),
+                                  width);
+      if (fwrite(row.data(), 1, bytes, file) != bytes) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool seek(int64_t offset) {
+#if defined _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+  }
+};
+
+/* A top-down BMP file mapped into memory.
+ *
+ * The pixel array of a top-down 32-bit BMP has the same layout as a PRGB32
+ * (or XRGB32) image, so the canvas can be created directly on top of the
+ * mapped file and the page is written as it is drawn. Finishing the page then
+ * only requires un-premultiplying translucent pixels (or setting the alpha of
+ * opaque canvases) in place and handing the mapping back to the OS. The pixel
+ * array is placed at a 64 byte aligned offset after the header. Mapping is
+ * only supported on POSIX systems, elsewhere open() always fails.
+ */
+class MappedBmp {
+  static const uint32_t PIXEL_OFFSET = 128;
+
+  uint32_t ppm;
+  uint8_t* map = NULL;
+  size_t size = 0;
+  size_t n_pixels = 0;
+  uint32_t format = BL_FORMAT_PRGB32;
+  int fd = -1;
+
+public:
+  MappedBmp(double res) :
+    ppm((uint32_t) (res / 0.0254 + 0.5))
+  {
+
+  }
+  ~MappedBmp() {
+    close();
+  }
+
+  /* Creates the file for a w x h page drawn on a canvas of the given format
+   * and maps it to memory. Returns the start of the pixel array or NULL if
+   * the file could not be mapped
+   */
+  uint32_t* open(const char* path, int w, int h,
+                 uint32_t canvas_format = BL_FORMAT_PRGB32) {
+    close();
+    format = canvas_format;
+#if defined _WIN32
+    return NULL;
+#else
+    n_pixels = (size_t) w * h;
+    size = PIXEL_OFFSET + 4 * n_pixels;
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return NULL;
+    // Reserve the blocks up front so a full disk fails here rather than with
+    // a bus error while drawing
+    if (ftruncate(fd, (off_t) size) != 0 || !reserve()) {
+      close();
+      return NULL;
+    }
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      close();
+      return NULL;
+    }
+    map = (uint8_t*) addr;
+    bmp_header(map, w, h, true, ppm, PIXEL_OFFSET);
+    return (uint32_t*) (map + PIXEL_OFFSET);
+#endif
+  }
+
+  // Converts the pixels in place and closes the file. Dirty pages are written
+  // back by the OS, just as with a buffered write
+  bool finish() {
+    if (map == NULL) return false;
+    uint32_t* pixels = (uint32_t*) (map + PIXEL_OFFSET);
+    if (format == BL_FORMAT_XRGB32) {
+      PixelFormat<BL_FORMAT_XRGB32>::to_argb(pixels, n_pixels);
+    } else {
+      PixelFormat<BL_FORMAT_PRGB32>::to_argb(pixels, n_pixels);
+    }
+#if defined _WIN32
+    bool success = false;
+#else
+    bool success = msync(map, size, MS_ASYNC) == 0;
+#endif
+    return close() && success;
+  }
+
+  // Unmaps and closes the file without finishing it
+  bool close() {
+    bool success = true;
+#if !defined _WIN32
+    if (map != NULL) success = munmap(map, size) == 0;
+    if (fd >= 0) success = ::close(fd) == 0 && success;
+#endif
+    map = NULL;
+    fd = -1;
+    return success;
+  }
+
+private:
+  bool reserve() {
+#if defined __linux__
+    return posix_fallocate(fd, 0, (off_t) size) == 0;
+#else
+    return true;
+#endif
+  }
+};
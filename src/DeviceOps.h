@@ -0,0 +1,366 @@
+#pragma once
+
+#include "ink.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum DeviceOp {
+  OP_NEW_PAGE = 0,
+  OP_CLOSE = 1,
+  OP_CLIP = 2,
+  OP_LINE = 3,
+  OP_POLYLINE = 4,
+  OP_POLYGON = 5,
+  OP_PATH = 6,
+  OP_RECT = 7,
+  OP_CIRCLE = 8,
+  OP_TEXT = 9,
+  OP_STR_WIDTH = 10,
+  OP_METRIC_INFO = 11,
+  OP_RASTER = 12,
+  OP_CAPTURE = 13,
+  OP_N = 14
+};
+
+static const char* const device_op_names[OP_N] = {
+  "newPage", "close", "clip", "line", "polyline", "polygon", "path", "rect",
+  "circle", "text", "strWidth", "metricInfo", "raster", "capture"
+};
+
+/* Binary encoding of the calls made to a device.
+ *
+ * Each call is appended as an opcode followed by its arguments as handed to
+ * the InkDevice method, i.e. after the relevant fields have been picked out
+ * of the graphics context. Coordinate arrays, strings and raster pixels are
+ * stored inline in native byte order. This is the format of both display
+ * lists (DisplayList.h), which hold the drawing calls of the current page in
+ * memory, and device traces (DeviceTrace.h), which stream every call to a
+ * file. Calls are decoded again with OpDecoder.
+ */
+class OpEncoder {
+protected:
+  std::vector<uint8_t> buffer;
+
+public:
+  const uint8_t* data() const { return buffer.data(); }
+  size_t bytes() const { return buffer.size(); }
+  bool empty() const { return buffer.empty(); }
+  void clear() { buffer.clear(); }
+
+  void page(unsigned int bg) {
+    put<uint8_t>(OP_NEW_PAGE);
+    put(bg);
+  }
+  void close() {
+    put<uint8_t>(OP_CLOSE);
+  }
+  void clip(double x0, double y0, double x1, double y1) {
+    put<uint8_t>(OP_CLIP);
+    put(x0); put(y0); put(x1); put(y1);
+  }
+  void line(double x1, double y1, double x2, double y2, int col, double lwd,
+            int lty, R_GE_lineend lend) {
+    put<uint8_t>(OP_LINE);
+    put(x1); put(y1); put(x2); put(y2); put(col); put(lwd); put(lty);
+    put(lend);
+  }
+  void polyline(int n, const double* x, const double* y, int col, double lwd,
+                int lty, R_GE_lineend lend, R_GE_linejoin ljoin,
+                double lmitre) {
+    put<uint8_t>(OP_POLYLINE);
+    put(n); put_bytes(x, n * sizeof(double)); put_bytes(y, n * sizeof(double));
+    put(col); put(lwd); put(lty); put(lend); put(ljoin); put(lmitre);
+  }
+  void polygon(int n, const double* x, const double* y, int fill, int col,
+               double lwd, int lty, R_GE_lineend lend, R_GE_linejoin ljoin,
+               double lmitre) {
+    put<uint8_t>(OP_POLYGON);
+    put(n); put_bytes(x, n * sizeof(double)); put_bytes(y, n * sizeof(double));
+    put(fill); put(col); put(lwd); put(lty); put(lend); put(ljoin);
+    put(lmitre);
+  }
+  void path(int npoly, const int* nper, const double* x, const double* y,
+            int col, int fill, double lwd, int lty, R_GE_lineend lend,
+            R_GE_linejoin ljoin, double lmitre, bool evenodd) {
+    put<uint8_t>(OP_PATH);
+    int n = 0;
+    put(npoly);
+    for (int i = 0; i < npoly; ++i) {
+      put(nper[i]);
+      n += nper[i];
+    }
+    put_bytes(x, n * sizeof(double)); put_bytes(y, n * sizeof(double));
+    put(col); put(fill); put(lwd); put(lty); put(lend); put(ljoin);
+    put(lmitre); put(evenodd);
+  }
+  void rect(double x0, double y0, double x1, double y1, int fill, int col,
+            double lwd, int lty, R_GE_lineend lend) {
+    put<uint8_t>(OP_RECT);
+    put(x0); put(y0); put(x1); put(y1); put(fill); put(col); put(lwd);
+    put(lty); put(lend);
+  }
+  void circle(double x, double y, double r, int fill, int col, double lwd,
+              int lty, R_GE_lineend lend) {
+    put<uint8_t>(OP_CIRCLE);
+    put(x); put(y); put(r); put(fill); put(col); put(lwd); put(lty);
+    put(lend);
+  }
+  void text(double x, double y, const char* str, const char* family, int face,
+            double size, double rot, double hadj, int col) {
+    put<uint8_t>(OP_TEXT);
+    put(x); put(y); put_string(str); put_string(family); put(face);
+    put(size); put(rot); put(hadj); put(col);
+  }
+  void str_width(const char* str, const char* family, int face,
+                 double size) {
+    put<uint8_t>(OP_STR_WIDTH);
+    put_string(str); put_string(family); put(face); put(size);
+  }
+  void metric_info(int c, const char* family, int face, double size) {
+    put<uint8_t>(OP_METRIC_INFO);
+    put(c); put_string(family); put(face); put(size);
+  }
+  void raster(const unsigned int* raster, int w, int h, double x, double y,
+              double final_width, double final_height, double rot,
+              bool interpolate) {
+    put<uint8_t>(OP_RASTER);
+    put(w); put(h);
+    put_bytes(raster, (size_t) w * h * sizeof(unsigned int));
+    put(x); put(y); put(final_width); put(final_height); put(rot);
+    put(interpolate);
+  }
+  void capture() {
+    put<uint8_t>(OP_CAPTURE);
+  }
+
+protected:
+  template<typename T>
+  void put(T value) {
+    put_bytes(&value, sizeof(T));
+  }
+  void put_bytes(const void* data, size_t n) {
+    size_t pos = buffer.size();
+    buffer.resize(pos + n);
+    if (n > 0) memcpy(buffer.data() + pos, data, n);
+  }
+  void put_string(const char* str) {
+    int n = strlen(str);
+    put(n);
+    put_bytes(str, n);
+  }
+};
+
+/* A single decoded call. Only the fields used by the call's opcode are
+ * updated
+ */
+struct OpCall {
+  DeviceOp op = OP_NEW_PAGE;
+  double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+  double r = 0, lwd = 0, lmitre = 0, size = 0, rot = 0, hadj = 0;
+  double final_width = 0, final_height = 0;
+  int fill = 0, col = 0, lty = 0, face = 0, c = 0, w = 0, h = 0;
+  unsigned int bg = 0;
+  R_GE_lineend lend = GE_ROUND_CAP;
+  R_GE_linejoin ljoin = GE_ROUND_JOIN;
+  bool flag = false; // evenodd for paths, interpolate for rasters
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<int> nper;
+  std::vector<unsigned int> pixels;
+  std::string str;
+  std::string family;
+};
+
+/* Sequential decoder of calls written by OpEncoder. Calls are decoded one at
+ * a time into a reused OpCall, so decoding does not allocate once its buffers
+ * have grown to fit. All reads are bounds checked so truncated or corrupt
+ * input ends the decoding rather than reading past the end
+ */
+class OpDecoder {
+  const uint8_t* pos;
+  const uint8_t* end;
+
+public:
+  OpDecoder(const uint8_t* data = NULL, size_t n = 0) :
+    pos(data),
+    end(data + n)
+  {
+
+  }
+
+  const uint8_t* position() const { return pos; }
+
+  /* Decodes the next call. Returns false at the end of the input or if it is
+   * truncated
+   */
+  bool next(OpCall& call) {
+    uint8_t code;
+    if (!get(code)) return false;
+    call.op = (DeviceOp) code;
+    switch (call.op) {
+    case OP_NEW_PAGE:
+      return get(call.bg);
+    case OP_CLOSE:
+    case OP_CAPTURE:
+      return true;
+    case OP_CLIP:
+      return get(call.x0) && get(call.y0) && get(call.x1) && get(call.y1);
+    case OP_LINE:
+      return get(call.x0) && get(call.y0) && get(call.x1) && get(call.y1) &&
+        get(call.col) && get(call.lwd) && get(call.lty) && get(call.lend);
+    case OP_POLYLINE:
+      return get(call.w) && get_array(call.x, call.w) &&
+        get_array(call.y, call.w) && get(call.col) && get(call.lwd) &&
+        get(call.lty) && get(call.lend) && get(call.ljoin) &&
+        get(call.lmitre);
+    case OP_POLYGON:
+      return get(call.w) && get_array(call.x, call.w) &&
+        get_array(call.y, call.w) && get(call.fill) && get(call.col) &&
+        get(call.lwd) && get(call.lty) && get(call.lend) && get(call.ljoin) &&
+        get(call.lmitre);
+    case OP_PATH: {
+      int npoly;
+      if (!get(npoly) || npoly < 0) return false;
+      call.nper.resize(npoly);
+      int n = 0;
+      for (int i = 0; i < npoly; ++i) {
+        if (!get(call.nper[i])) return false;
+        n += call.nper[i];
+      }
+      return get_array(call.x, n) && get_array(call.y, n) &&
+        get(call.col) && get(call.fill) && get(call.lwd) && get(call.lty) &&
+        get(call.lend) && get(call.ljoin) && get(call.lmitre) &&
+        get(call.flag);
+    }
+    case OP_RECT:
+      return get(call.x0) && get(call.y0) && get(call.x1) && get(call.y1) &&
+        get(call.fill) && get(call.col) && get(call.lwd) && get(call.lty) &&
+        get(call.lend);
+    case OP_CIRCLE:
+      return get(call.x0) && get(call.y0) && get(call.r) && get(call.fill) &&
+        get(call.col) && get(call.lwd) && get(call.lty) && get(call.lend);
+    case OP_TEXT:
+      return get(call.x0) && get(call.y0) && get_string(call.str) &&
+        get_string(call.family) && get(call.face) && get(call.size) &&
+        get(call.rot) && get(call.hadj) && get(call.col);
+    case OP_STR_WIDTH:
+      return get_string(call.str) && get_string(call.family) &&
+        get(call.face) && get(call.size);
+    case OP_METRIC_INFO:
+      return get(call.c) && get_string(call.family) && get(call.face) &&
+        get(call.size);
+    case OP_RASTER:
+      if (!get(call.w) || !get(call.h) || call.w < 0 || call.h < 0 ||
+          (size_t) (end - pos) / sizeof(unsigned int) <
+            (size_t) call.w * call.h) {
+        return false;
+      }
+      call.pixels.resize((size_t) call.w * call.h);
+      return get_bytes(call.pixels.data(),
+                       call.pixels.size() * sizeof(unsigned int)) &&
+        get(call.x0) && get(call.y0) && get(call.final_width) &&
+        get(call.final_height) && get(call.rot) && get(call.flag);
+    default:
+      return false;
+    }
+  }
+
+  // Values are copied out with memcpy as they are not aligned
+  bool get_bytes(void* out, size_t n) {
+    if ((size_t) (end - pos) < n) return false;
+    if (n > 0) memcpy(out, pos, n);
+    pos += n;
+    return true;
+  }
+  template<typename T>
+  bool get(T& value) {
+    return get_bytes(&value, sizeof(T));
+  }
+
+private:
+  bool get_array(std::vector<double>& out, int n) {
+    if (n < 0 || (size_t) (end - pos) / sizeof(double) < (size_t) n) {
+      return false;
+    }
+    out.resize(n);
+    return get_bytes(out.data(), n * sizeof(double));
+  }
+  bool get_string(std::string& out) {
+    int n;
+    if (!get(n) || n < 0 || (size_t) (end - pos) < (size_t) n) return false;
+    out.assign((const char*) pos, n);
+    pos += n;
+    return true;
+  }
+};
+
+/* Calls the device method matching a decoded call. Text calls are dispatched
+ * like the others, so a device that cannot reach the font libraries (e.g.
+ * outside of R) should hide drawText(), stringWidth() and charMetric()
+ */
+template<class Device>
+void op_apply(Device& device, OpCall& call) {
+  double ascent, descent, width;
+  switch (call.op) {
+  case OP_NEW_PAGE:
+    device.newPage(call.bg);
+    break;
+  case OP_CLOSE:
+    device.close();
+    break;
+  case OP_CLIP:
+    device.clipRect(call.x0, call.y0, call.x1, call.y1);
+    break;
+  case OP_LINE:
+    device.drawLine(call.x0, call.y0, call.x1, call.y1, call.col, call.lwd,
+                    call.lty, call.lend);
+    break;
+  case OP_POLYLINE:
+    device.drawPolyline(call.w, call.x.data(), call.y.data(), call.col,
+                        call.lwd, call.lty, call.lend, call.ljoin,
+                        call.lmitre);
+    break;
+  case OP_POLYGON:
+    device.drawPolygon(call.w, call.x.data(), call.y.data(), call.fill,
+                       call.col, call.lwd, call.lty, call.lend, call.ljoin,
+                       call.lmitre);
+    break;
+  case OP_PATH:
+    device.drawPath(call.nper.size(), call.nper.data(), call.x.data(),
+                    call.y.data(), call.col, call.fill, call.lwd, call.lty,
+                    call.lend, call.ljoin, call.lmitre, call.flag);
+    break;
+  case OP_RECT:
+    device.drawRect(call.x0, call.y0, call.x1, call.y1, call.fill, call.col,
+                    call.lwd, call.lty, call.lend);
+    break;
+  case OP_CIRCLE:
+    device.drawCircle(call.x0, call.y0, call.r, call.fill, call.col, call.lwd,
+                      call.lty, call.lend);
+    break;
+  case OP_TEXT:
+    device.drawText(call.x0, call.y0, call.str.c_str(), call.family.c_str(),
+                    call.face, call.size, call.rot, call.hadj, call.col);
+    break;
+  case OP_STR_WIDTH:
+    device.stringWidth(call.str.c_str(), call.family.c_str(), call.face,
+                       call.size);
+    break;
+  case OP_METRIC_INFO:
+    device.charMetric(call.c, call.family.c_str(), call.face, call.size,
+                      &ascent, &descent, &width);
+    break;
+  case OP_RASTER:
+    device.drawRaster(call.pixels.data(), call.w, call.h, call.x0, call.y0,
+                      call.final_width, call.final_height, call.rot,
+                      call.flag);
+    break;
+  case OP_CAPTURE:
+    device.capture();
+    break;
+  default:
+    break;
+  }
+}
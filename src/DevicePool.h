@@ -0,0 +1,108 @@
+#pragma once
+
+#include "ink.h"
+#include "TextRenderer.h"
+
+#include <list>
+
+/* Pool of the parts of closed devices that are costly to set up again.
+ *
+ * Opening a device allocates a canvas and starts with a cold text renderer
+ * that has to look up and load its fonts and shape every string anew. When a
+ * device owning a plain in-memory canvas is closed, its canvas and text
+ * renderer are handed to the pool, and the next device opened with the same
+ * dimensions and pixel format takes them over instead. Backends are kept in
+ * order of use and the least recently used are released once the pool grows
+ * beyond its memory limit. A limit of 0 disables pooling.
+ *
+ * The pool is shared by all devices and only used from the main R thread.
+ */
+class DevicePool {
+public:
+  struct Backend {
+    BLImage canvas;
+    TextRenderer text_renderer;
+  };
+
+  size_t hits = 0;
+  size_t misses = 0;
+
+  DevicePool(size_t max_bytes) : max_bytes(max_bytes) {}
+
+  size_t n_entries() const { return entries.size(); }
+  size_t bytes() const { return size; }
+  size_t limit() const { return max_bytes; }
+  void set_limit(size_t bytes) {
+    max_bytes = bytes;
+    trim();
+  }
+
+  bool has(int w, int h, uint32_t format) const {
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      if (it->width == w && it->height == h && it->format == format) {
+        return true;
+      }
+    }
+    return false;
+  }
+  // Moves the most recently pooled backend of the given kind into backend
+  bool take(int w, int h, uint32_t format, Backend& backend) {
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      if (it->width == w && it->height == h && it->format == format) {
+        backend.canvas = std::move(it->backend.canvas);
+        backend.text_renderer = std::move(it->backend.text_renderer);
+        size -= it->bytes;
+        entries.erase(it);
+        hits++;
+        return true;
+      }
+    }
+    misses++;
+    return false;
+  }
+  // Takes over the backend of a closing device, if it fits within the limit
+  void put(Backend& backend) {
+    BLImageData data;
+    if (backend.canvas.getData(&data) != BL_SUCCESS) return;
+    size_t bytes = (size_t) data.stride * data.size.h +
+      backend.text_renderer.shape_cache.bytes();
+    if (bytes > max_bytes) return;
+    entries.push_front(Entry());
+    Entry& entry = entries.front();
+    entry.width = data.size.w;
+    entry.height = data.size.h;
+    entry.format = data.format;
+    entry.bytes = bytes;
+    entry.backend.canvas = std::move(backend.canvas);
+    entry.backend.text_renderer = std::move(backend.text_renderer);
+    size += bytes;
+    trim();
+  }
+  void flush() {
+    entries.clear();
+    size = 0;
+  }
+
+private:
+  struct Entry {
+    int width;
+    int height;
+    uint32_t format;
+    size_t bytes;
+    Backend backend;
+  };
+
+  std::list<Entry> entries;
+  size_t size = 0;
+  size_t max_bytes;
+
+  void trim() {
+    while (size > max_bytes && !entries.empty()) {
+      size -= entries.back().bytes;
+      entries.pop_back();
+    }
+  }
+};
+
+// The pool shared by all devices. Defined in init.cpp
+DevicePool& get_device_pool();
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "DeviceOps.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Cached pieces of context state, checked before being set on the context
+enum StateCache {
+  STATE_COLOUR = 0,
+  STATE_FILL = 1,
+  STATE_LINEWIDTH = 2,
+  STATE_LINETYPE = 3,
+  STATE_LINEEND = 4,
+  STATE_LINEJOIN = 5,
+  STATE_MITRE = 6,
+  STATE_N = 7
+};
+
+static const char* const state_cache_names[STATE_N] = {
+  "colour", "fill", "linewidth", "linetype", "lineend", "linejoin", "mitre"
+};
+
+// The steps of finishing a page
+enum PagePhase {
+  PHASE_SYNC = 0,  // Waiting for the worker threads to finish rendering
+  PHASE_SAVE = 1,  // savePage() (or writing the bands) on the main thread
+  PHASE_QUEUE = 2, // Handing the page to the encoder thread
+  PHASE_WRITE = 3, // writePage() on the encoder thread
+  PHASE_N = 4
+};
+
+static const char* const page_phase_names[PHASE_N] = {
+  "sync", "savePage", "queuePage", "writePage"
+};
+
+/* Performance counters of a single device.
+ *
+ * The number of calls and the time spent in each device callback are
+ * accumulated together with the hit rate of the context state caches and the
+ * time spent finishing pages. A timeline of each page is kept as well,
+ * which can be exported in the Chrome trace event format (for viewing in
+ * chrome://tracing or Perfetto). Consecutive calls of the same kind on a page
+ * are merged into one timeline event to keep the timeline small.
+ *
+ * Devices only hold a DeviceStats when asked to, and all instrumentation
+ * checks for it first, so disabled stats cost a branch per call. Callback and
+ * state counters are only updated from the main thread. Page phases may be
+ * reported from the encoder thread and are guarded by a mutex.
+ */
+class DeviceStats {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  struct Counter {
+    size_t count = 0;
+    double time = 0.0;
+  };
+
+  Counter calls[OP_N];
+  Counter phases[PHASE_N];
+  size_t state_hits[STATE_N];
+  size_t state_misses[STATE_N];
+  size_t dropped_events = 0;
+
+  DeviceStats() :
+    origin(clock::now())
+  {
+    reset();
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < OP_N; ++i) calls[i] = Counter();
+    for (int i = 0; i < PHASE_N; ++i) phases[i] = Counter();
+    for (int i = 0; i < STATE_N; ++i) {
+      state_hits[i] = 0;
+      state_misses[i] = 0;
+    }
+    dropped_events = 0;
+    events.clear();
+    pages.clear();
+  }
+
+  inline void state(StateCache which, bool hit) {
+    if (hit) {
+      state_hits[which]++;
+    } else {
+      state_misses[which]++;
+    }
+  }
+  void call(DeviceOp op, clock::time_point start, clock::time_point end,
+            int page) {
+    double begin = seconds(start);
+    double duration = seconds(end) - begin;
+    calls[op].count++;
+    calls[op].time += duration;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pages.empty() || pages.back().page != page) {
+      add_event(pages, Event(-1, 1, page, begin));
+    }
+    pages.back().end = begin + duration;
+    if (!events.empty() && events.back().name == op &&
+        events.back().page == page && last_was_call) {
+      Event& event = events.back();
+      event.end = begin + duration;
+      event.busy += duration;
+      event.calls++;
+      return;
+    }
+    last_was_call = add_event(events, Event(op, 1, page, begin, duration));
+  }
+  void phase(PagePhase which, clock::time_point start, clock::time_point end,
+             int page) {
+    double begin = seconds(start);
+    double duration = seconds(end) - begin;
+    std::lock_guard<std::mutex> lock(mutex);
+    phases[which].count++;
+    phases[which].time += duration;
+    int tid = which == PHASE_WRITE ? 2 : 1;
+    add_event(events, Event(OP_N + which, tid, page, begin, duration));
+    last_was_call = false;
+  }
+
+  // Writes the timeline as Chrome trace events. Times are in microseconds
+  bool write_timeline(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":1,\"args\":{\"name\":\"device\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":2,\"args\":{\"name\":\"encoder\"}}");
+    for (size_t i = 0; i < pages.size(); ++i) {
+      const Event& page = pages[i];
+      fprintf(file, ",\n{\"name\":\"page %d\",\"cat\":\"page\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}", page.page,
+              1e6 * page.start, 1e6 * (page.end - page.start));
+    }
+    for (size_t i = 0; i < events.size(); ++i) {
+      const Event& event = events[i];
+      bool is_call = event.name < OP_N;
+      const char* name = is_call ? device_op_names[event.name] :
+        page_phase_names[event.name - OP_N];
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"page\":%d", name, is_call ? "call" : "output",
+              1e6 * event.start, 1e6 * (event.end - event.start), event.tid,
+              event.page);
+      if (is_call) {
+        fprintf(file, ",\"calls\":%ld,\"busy_us\":%.3f", event.calls,
+                1e6 * event.busy);
+      }
+      fprintf(file, "}}");
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+  }
+
+private:
+  // Bounds the memory used by the timeline. Later events are dropped
+  static const size_t MAX_EVENTS = 1 << 17;
+
+  struct Event {
+    int name; // A DeviceOp, or OP_N + a PagePhase
+    int tid;
+    int page;
+    double start;
+    double end;
+    double busy;
+    long calls;
+
+    Event(int name, int tid, int page, double start, double duration = 0.0) :
+      name(name), tid(tid), page(page), start(start), end(start + duration),
+      busy(duration), calls(1) {}
+  };
+
+  clock::time_point origin;
+  bool last_was_call = false;
+  std::mutex mutex;
+  std::vector<Event> events;
+  std::vector<Event> pages;
+
+  double seconds(clock::time_point time) const {
+    return std::chrono::duration<double>(time - origin).count();
+  }
+  bool add_event(std::vector<Event>& list, const Event& event) {
+    if (list.size() >= MAX_EVENTS) {
+      dropped_events++;
+      return false;
+    }
+    list.push_back(event);
+    return true;
+  }
+};
+
+// Times a device callback for the lifetime of the object
+class CallTimer {
+  DeviceStats* stats;
+  DeviceOp op;
+  int page;
+  DeviceStats::clock::time_point start;
+
+public:
+  CallTimer(DeviceStats* stats, DeviceOp op, int page) :
+    stats(stats), op(op), page(page)
+  {
+    if (stats) start = DeviceStats::clock::now();
+  }
+  ~CallTimer() {
+    if (stats) stats->call(op, start, DeviceStats::clock::now(), page);
+  }
+};
+
+// Times a step of finishing a page for the lifetime of the object
+class PhaseTimer {
+  DeviceStats* stats;
+  PagePhase phase;
+  int page;
+  DeviceStats::clock::time_point start;
+
+public:
+  PhaseTimer(DeviceStats* stats, PagePhase phase, int page) :
+    stats(stats), phase(phase), page(page)
+  {
+    if (stats) start = DeviceStats::clock::now();
+  }
+  ~PhaseTimer() {
+    if (stats) stats->phase(phase, start, DeviceStats::clock::now(), page);
+  }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "ink.h"
+#include "DeviceOps.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const char TRACE_MAGIC[8] = {'I', 'N', 'K', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t TRACE_VERSION = 1;
+
+/* The settings of the device a trace was taken from. Written once at the start
+ * of the file
+ */
+struct TraceHeader {
+  int width = 0;
+  int height = 0;
+  double pointsize = 12;
+  unsigned int background = 0;
+  double res = 72;
+  double scaling = 1;
+};
+
+/* Writer of a binary trace of the graphics engine calls received by a device.
+ *
+ * A trace is a header followed by every callback in init_device.h, encoded
+ * the same way as display lists (see DeviceOps.h) but including the calls
+ * that do not draw (string widths, font metrics, captures and closing the
+ * device). Calls are collected in a buffer which is written to the file in
+ * large chunks so tracing adds little to the cost of each call. Traces are
+ * read back with TraceReader, e.g. by the replay benchmark in tools/bench.
+ */
+class DeviceTrace {
+  static const size_t FLUSH_SIZE = 1 << 20;
+
+  FILE* file = NULL;
+  bool failed = false;
+  OpEncoder ops;
+
+public:
+  DeviceTrace() {}
+  ~DeviceTrace() {
+    finish();
+  }
+
+  bool open(const char* path, const TraceHeader& header) {
+    finish();
+    file = fopen(path, "wb");
+    if (file == NULL) return false;
+    failed = false;
+    ops.clear();
+    write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    write(&TRACE_VERSION, sizeof(TRACE_VERSION));
+    write(&header.width, sizeof(header.width));
+    write(&header.height, sizeof(header.height));
+    write(&header.pointsize, sizeof(header.pointsize));
+    write(&header.background, sizeof(header.background));
+    write(&header.res, sizeof(header.res));
+    write(&header.scaling, sizeof(header.scaling));
+    return true;
+  }
+  // Writes the remaining calls and closes the file. Returns false if any part
+  // of the trace could not be written
+  bool finish() {
+    if (file == NULL) return true;
+    flush();
+    bool success = fclose(file) == 0 && !failed;
+    file = NULL;
+    return success;
+  }
+
+  // The encoder to append the next call to. Calls recorded so far are written
+  // out first once they fill the buffer
+  OpEncoder& record() {
+    if (ops.bytes() >= FLUSH_SIZE) flush();
+    return ops;
+  }
+
+private:
+  void flush() {
+    if (ops.empty()) return;
+    write(ops.data(), ops.bytes());
+    ops.clear();
+  }
+  void write(const void* data, size_t n) {
+    if (fwrite(data, 1, n, file) != n) {
+      failed = true;
+    }
+  }
+};
+
+/* Reader of traces written by DeviceTrace. The file is read into memory in
+ * full and the calls are decoded one at a time with OpDecoder
+ */
+class TraceReader {
+  std::vector<uint8_t> data;
+  size_t header_size = 0;
+  OpDecoder in;
+
+public:
+  TraceHeader header;
+
+  bool open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    data.clear();
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(file);
+    in = OpDecoder(data.data(), data.size());
+
+    char magic[sizeof(TRACE_MAGIC)];
+    uint32_t version = 0;
+    if (!in.get_bytes(magic, sizeof(magic)) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 || !in.get(version) ||
+        version != TRACE_VERSION) {
+      return false;
+    }
+    bool valid = in.get(header.width) && in.get(header.height) &&
+      in.get(header.pointsize) && in.get(header.background) &&
+      in.get(header.res) && in.get(header.scaling);
+    header_size = in.position() - data.data();
+    return valid;
+  }
+  // Starts over from the first call
+  void rewind() {
+    in = OpDecoder(data.data() + header_size, data.size() - header_size);
+  }
+
+  /* Decodes the next call. Returns false at the end of the trace or if the
+   * trace is truncated
+   */
+  bool next(OpCall& call) {
+    return in.next(call);
+  }
+};
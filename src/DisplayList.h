@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ink.h"
+#include "DeviceOps.h"
+
+#include <cmath>
+
+/* Compact recording of the device calls making up a page.
+ *
+ * Calls are appended with the encoding shared with device traces (see
+ * DeviceOps.h). Geometry is recorded in device pixels of the recording
+ * device, while line widths and font sizes are recorded as given by R so that
+ * the device replayed into applies its own resolution and scaling to them.
+ * This allows a page to be rendered again at another size or resolution
+ * without going through the graphics engine.
+ */
+class DisplayList : public OpEncoder {
+public:
+  int width;
+  int height;
+
+  DisplayList(int w = 0, int h = 0) : width(w), height(h) {}
+
+  /* Replays the recorded calls into device. Coordinates are scaled by sx and
+   * sy and then offset by dx and dy. The page call starting the recording
+   * clears the page rather than starting a new one
+   */
+  template<class Device>
+  void replay(Device& device, double sx, double sy, double dx = 0.0,
+              double dy = 0.0) const {
+    OpDecoder in(data(), bytes());
+    OpCall call;
+    double r_scale = std::sqrt(sx * sy);
+
+    while (in.next(call)) {
+      // Only the fields decoded for this call are transformed
+      switch (call.op) {
+      case OP_NEW_PAGE:
+        device.clearPage(call.bg);
+        continue;
+      case OP_POLYLINE:
+      case OP_POLYGON:
+      case OP_PATH:
+        for (size_t i = 0; i < call.x.size(); ++i) {
+          call.x[i] = call.x[i] * sx + dx;
+          call.y[i] = call.y[i] * sy + dy;
+        }
+        break;
+      case OP_CLIP:
+      case OP_LINE:
+      case OP_RECT:
+        call.x1 = call.x1 * sx + dx;
+        call.y1 = call.y1 * sy + dy;
+        call.x0 = call.x0 * sx + dx;
+        call.y0 = call.y0 * sy + dy;
+        break;
+      case OP_CIRCLE:
+        call.r *= r_scale;
+        call.x0 = call.x0 * sx + dx;
+        call.y0 = call.y0 * sy + dy;
+        break;
+      case OP_RASTER:
+        call.final_width *= sx;
+        call.final_height *= sy;
+        call.x0 = call.x0 * sx + dx;
+        call.y0 = call.y0 * sy + dy;
+        break;
+      case OP_TEXT:
+        call.x0 = call.x0 * sx + dx;
+        call.y0 = call.y0 * sy + dy;
+        break;
+      default:
+        break;
+      }
+      op_apply(device, call);
+    }
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "ink.h"
+
+#include <cmath>
+#include <vector>
+
+/* Batch of consecutive primitives sharing the same drawing state.
+ *
+ * points() and segments() calls lead to a single device callback per shape.
+ * Rather than issuing a fill or stroke for each of them, shapes drawn with the
+ * same state are collected in a single path which is rendered in one go once
+ * the state changes. This is only pixel-identical to drawing the shapes one by
+ * one if they don't overlap, as coverage of overlapping anti-aliased edges is
+ * accumulated differently within a single path than when compositing separate
+ * draws. The batch therefore keeps a coarse occupancy grid of the canvas and
+ * refuses any shape whose (conservative) footprint touches a cell already
+ * covered by the batch, in which case the batch must be flushed first.
+ */
+class DrawBatch {
+  static const int CELL_SHIFT = 3; // 8x8 px cells
+  static const int MAX_CELLS = 64;
+  static const size_t MAX_SHAPES = 4096;
+
+  int cols;
+  int rows;
+  std::vector<uint8_t> occupied;
+  std::vector<int> touched;
+  size_t n = 0;
+
+public:
+  BLPath path;
+  bool fill = false;
+  bool stroke = false;
+
+  DrawBatch(int w, int h) :
+    cols(((w > 0 ? w : 1) + 7) >> CELL_SHIFT),
+    rows(((h > 0 ? h : 1) + 7) >> CELL_SHIFT),
+    occupied((size_t) cols * rows, 0)
+  {
+
+  }
+
+  bool empty() const { return n == 0; }
+
+  /* Claims the cells covered by the box (x0, y0, x1, y1) for a shape with the
+   * given kind of drawing. Returns false if the shape cannot be added to the
+   * current batch, either because it is drawn differently, because it
+   * overlaps a previous shape, or because it is too large to be worth
+   * batching. The caller should flush and try again if the batch is not empty.
+   */
+  bool claim(bool draw_fill, bool draw_stroke, double x0, double y0,
+             double x1, double y1) {
+    if (n > 0 && (draw_fill != fill || draw_stroke != stroke)) return false;
+    if (n >= MAX_SHAPES) return false;
+
+    // Expand by a pixel for anti-aliasing
+    int cx0 = cell(x0 - 1.0, cols);
+    int cx1 = cell(x1 + 1.0, cols);
+    int cy0 = cell(y0 - 1.0, rows);
+    int cy1 = cell(y1 + 1.0, rows);
+    if ((cx1 - cx0 + 1) * (cy1 - cy0 + 1) > MAX_CELLS) return false;
+
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      const uint8_t* row = occupied.data() + (size_t) cy * cols;
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        if (row[cx]) return false;
+      }
+    }
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        int i = cy * cols + cx;
+        occupied[i] = 1;
+        touched.push_back(i);
+      }
+    }
+    fill = draw_fill;
+    stroke = draw_stroke;
+    n++;
+    return true;
+  }
+
+  void reset() {
+    for (size_t i = 0; i < touched.size(); ++i) {
+      occupied[touched[i]] = 0;
+    }
+    touched.clear();
+    path.clear();
+    n = 0;
+  }
+
+private:
+  // Cell index of a coordinate, clamped to the grid. Shapes entirely off
+  // canvas end up claiming a border cell which is harmless
+  static int cell(double v, int n_cells) {
+    if (!(v > 0.0)) return 0;
+    if (v >= (double) (n_cells << CELL_SHIFT)) return n_cells - 1;
+    return (int) v >> CELL_SHIFT;
+  }
+};
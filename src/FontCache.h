@@ -0,0 +1,196 @@
+#pragma once
+
+#include "ink.h"
+#include "GlyphMetrics.h"
+
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <systemfonts.h>
+
+/* Process-wide cache of fonts.
+ *
+ * Plots usually alternate between a handful of fonts (e.g. a bold title and
+ * plain axis text). Rather than reloading the font file every time the font
+ * changes, ink keeps three bounded caches shared by all open devices: the
+ * font file located for a family and face, the loaded font face for a file
+ * and face index, and the sized font (along with its glyph metric table) for
+ * a face and size. Blend2D objects are reference counted, and the metric
+ * tables are shared pointers, so a font handed out stays valid even if it is
+ * later evicted. The cache is only used from the main R thread.
+ */
+class FontCache {
+  static const size_t MAX_LOCATIONS = 256;
+  static const size_t MAX_FACES = 32;
+  static const size_t MAX_FONTS = 256;
+
+  static size_t hash_combine(size_t seed, size_t v) {
+    return seed ^ (v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+  }
+
+  struct LocationKey {
+    std::string family;
+    int face;
+    bool operator==(const LocationKey& other) const {
+      return face == other.face && family == other.family;
+    }
+  };
+  struct LocationHash {
+    size_t operator()(const LocationKey& k) const {
+      return hash_combine(std::hash<std::string>()(k.family), k.face);
+    }
+  };
+  struct FaceKey {
+    std::string file;
+    unsigned int index;
+    bool operator==(const FaceKey& other) const {
+      return index == other.index && file == other.file;
+    }
+  };
+  struct FaceHash {
+    size_t operator()(const FaceKey& k) const {
+      return hash_combine(std::hash<std::string>()(k.file), k.index);
+    }
+  };
+  struct FontKey {
+    FaceKey face;
+    float size;
+    bool operator==(const FontKey& other) const {
+      return size == other.size && face == other.face;
+    }
+  };
+  struct FontHash {
+    size_t operator()(const FontKey& k) const {
+      return hash_combine(FaceHash()(k.face), std::hash<float>()(k.size));
+    }
+  };
+
+  struct SizedFont {
+    BLFont font;
+    std::shared_ptr<GlyphMetrics> metrics;
+  };
+
+  // Minimal LRU map
+  template<typename K, typename V, typename H>
+  class Lru {
+    typedef std::pair<K, V> Entry;
+    std::list<Entry> entries;
+    std::unordered_map<K, typename std::list<Entry>::iterator, H> index;
+    size_t limit;
+  public:
+    Lru(size_t limit) : limit(limit) {}
+    V* find(const K& key) {
+      auto it = index.find(key);
+      if (it == index.end()) return NULL;
+      entries.splice(entries.begin(), entries, it->second);
+      return &it->second->second;
+    }
+    V* insert(const K& key, const V& value) {
+      while (entries.size() >= limit) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+      }
+      entries.push_front(Entry(key, value));
+      index[key] = entries.begin();
+      return &entries.front().second;
+    }
+    size_t size() const { return entries.size(); }
+    void clear() {
+      entries.clear();
+      index.clear();
+    }
+  };
+
+  Lru<LocationKey, FontSettings, LocationHash> locations;
+  Lru<FaceKey, BLFontFace, FaceHash> faces;
+  Lru<FontKey, SizedFont, FontHash> fonts;
+
+  LocationKey location_key;
+  FontKey font_key;
+
+public:
+  size_t hits = 0;
+  size_t misses = 0;
+
+  FontCache() :
+    locations(MAX_LOCATIONS),
+    faces(MAX_FACES),
+    fonts(MAX_FONTS)
+  {
+
+  }
+
+  size_t n_entries() const { return faces.size() + fonts.size(); }
+
+  /* Finds the font file for the family and R fontface (1: plain, 2: bold,
+   * 3: italic, 4: bold-italic, 5: symbol)
+   */
+  const FontSettings& locate(const char* family, int face) {
+    location_key.family.assign(family);
+    location_key.face = face;
+    FontSettings* settings = locations.find(location_key);
+    if (settings != NULL) {
+      return *settings;
+    }
+    const char* fontfamily = family;
+    if (face == 5) {
+#if defined _WIN32
+      fontfamily = "Segoe UI Symbol";
+#else
+      fontfamily = "Symbol";
+#endif
+    }
+    FontSettings located = locate_font_with_features(fontfamily,
+                                                     face == 3 || face == 4,
+                                                     face == 2 || face == 4);
+    return *locations.insert(location_key, located);
+  }
+
+  // Sets font to the font at the given size (and metrics to its glyph metric
+  // table), loading the face if needed
+  BLResult get_font(const FontSettings& settings, double size, BLFont& font,
+                    std::shared_ptr<GlyphMetrics>& metrics) {
+    font_key.face.file.assign(settings.file);
+    font_key.face.index = settings.index;
+    font_key.size = (float) size;
+    SizedFont* cached = fonts.find(font_key);
+    if (cached != NULL) {
+      hits++;
+      font = cached->font;
+      metrics = cached->metrics;
+      return BL_SUCCESS;
+    }
+    misses++;
+
+    BLResult err = BL_SUCCESS;
+    BLFontFace* face = faces.find(font_key.face);
+    if (face == NULL) {
+      BLFontData data;
+      err = data.createFromFile(settings.file, BL_FILE_READ_MMAP_ENABLED);
+      if (err != BL_SUCCESS) return err;
+      BLFontFace new_face;
+      err = new_face.createFromData(data, settings.index);
+      if (err != BL_SUCCESS) return err;
+      face = faces.insert(font_key.face, new_face);
+    }
+    SizedFont sized;
+    err = sized.font.createFromFace(*face, (float) size);
+    if (err != BL_SUCCESS) return err;
+    sized.metrics = std::make_shared<GlyphMetrics>(sized.font);
+    fonts.insert(font_key, sized);
+    font = sized.font;
+    metrics = sized.metrics;
+    return BL_SUCCESS;
+  }
+
+  void clear() {
+    locations.clear();
+    faces.clear();
+    fonts.clear();
+  }
+};
+
+// The cache shared by all devices. Defined in init.cpp
+FontCache& get_font_cache();
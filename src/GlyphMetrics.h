@@ -0,0 +1,69 @@
+#pragma once
+
+#include "ink.h"
+
+#include <unordered_map>
+
+struct GlyphMetric {
+  double ascent;
+  double descent;
+  double width;
+};
+
+/* Table of glyph metrics for a single font at a given size.
+ *
+ * The graphics engine asks for character metrics constantly (for plotmath,
+ * pch characters, and vertical text alignment). Metrics are measured the
+ * first time a code point is requested and kept in a dense table for
+ * ASCII/Latin-1 and a hash map beyond that, so subsequent lookups are O(1).
+ * Ascent and descent are taken from the glyph bounding box and width is the
+ * advance.
+ */
+class GlyphMetrics {
+  static const int DENSE_SIZE = 256;
+
+  BLFont font;
+  GlyphMetric dense[DENSE_SIZE];
+  bool known[DENSE_SIZE];
+  std::unordered_map<uint32_t, GlyphMetric> sparse;
+  BLGlyphBuffer buffer;
+
+public:
+  GlyphMetrics(const BLFont& font) : font(font) {
+    for (int i = 0; i < DENSE_SIZE; ++i) known[i] = false;
+  }
+
+  const GlyphMetric& get(uint32_t code) {
+    if (code < DENSE_SIZE) {
+      if (!known[code]) {
+        dense[code] = measure(code);
+        known[code] = true;
+      }
+      return dense[code];
+    }
+    auto it = sparse.find(code);
+    if (it == sparse.end()) {
+      it = sparse.insert(std::make_pair(code, measure(code))).first;
+    }
+    return it->second;
+  }
+
+private:
+  GlyphMetric measure(uint32_t code) {
+    GlyphMetric metric = {0.0, 0.0, 0.0};
+    BLTextMetrics tm;
+    tm.reset();
+    if (buffer.setUtf32Text(&code, 1) != BL_SUCCESS ||
+        font.shape(buffer) != BL_SUCCESS ||
+        font.getTextMetrics(buffer, tm) != BL_SUCCESS) {
+      return metric;
+    }
+    // Blank glyphs (e.g. space) have no extent
+    if (tm.boundingBox.y1 > tm.boundingBox.y0) {
+      metric.ascent = -tm.boundingBox.y0;
+      metric.descent = tm.boundingBox.y1;
+    }
+    metric.width = tm.advance.x;
+    return metric;
+  }
+};
@@ -1,7 +1,23 @@
 #pragma once
 
 #include "ink.h"
+#include "DeviceStats.h"
+#include "DeviceTrace.h"
+#include "DevicePool.h"
+#include "DisplayList.h"
+#include "DrawBatch.h"
 #include "TextRenderer.h"
+#include "PageEncoder.h"
+#include "PathOps.h"
+#include "PixelFormat.h"
+#include "PixelOps.h"
+#include "RasterCache.h"
+#include "SpriteCache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
 
 /* Base class for graphic device interface to Blend2D.
  *
@@ -11,13 +27,16 @@
  */
 class InkDevice {
 public:
+  // XRGB32 for opaque devices, PRGB32 otherwise
+  uint32_t format;
   BLImage canvas;
   BLContext context;
 
-  bool can_capture = false;
+  bool can_capture = true;
 
   int width;
   int height;
+  int threads;
   double clip_left;
   double clip_right;
   double clip_top;
@@ -32,15 +51,35 @@ public:
   double lwd_mod;
 
   TextRenderer text_renderer;
+  std::unique_ptr<PageEncoder> encoder;
+  RasterCache raster_cache;
+  SpriteCache sprite_cache;
+  bool use_sprites;
+  bool use_decimation;
+  bool use_snapping;
+  bool recording;
+  DisplayList display_list;
+  int band;
+  std::unique_ptr<DeviceTrace> trace;
+  std::unique_ptr<DeviceStats> stats;
 
   // Lifecycle methods
   InkDevice(const char* fp, int w, int h, double ps, int bg, double res,
-            double scaling);
+            double scaling, const InkOptions& options);
   virtual ~InkDevice();
   void newPage(unsigned int bg, bool increase_pageno = true);
+  void clearPage(unsigned int bg);
   void close();
+  bool finishPage(bool last);
   virtual bool savePage();
+  virtual bool writePage(const BLImage& image, int page);
+  virtual bool beginBands(int page);
+  virtual bool writeBand(const BLImage& image, int rows);
+  virtual bool endBands();
   SEXP capture();
+  void replay(const DisplayList& list);
+  void attachCanvas(BLImage& image);
+  void detachCanvas();
 
   // Behaviour
   void clipRect(double x0, double y0, double x1, double y1);
@@ -79,6 +118,40 @@ private:
   R_GE_linejoin ljoin_cur = GE_MITRE_JOIN;
   double mitre_cur = -1.0;
 
+  // Whether the clip rect of the context matches clip_*
+  bool clip_valid = false;
+
+  // The rows of the page currently on the canvas
+  int band_top;
+  int band_bottom;
+
+  // Whether the canvas is plain memory allocated by the device, which can be
+  // handed to the device pool when closing
+  bool owns_canvas;
+
+  // Pages are cleared lazily. clearPage() only notes the background and the
+  // canvas is cleared when the page is first drawn on or finished. Only the
+  // dirty box, the part drawn on since the canvas was last cleared to clean_bg,
+  // needs clearing if the background is unchanged
+  bool clear_pending = false;
+  unsigned int pending_bg = 0;
+  unsigned int clean_bg = 0;
+  BLBoxI dirty;
+
+  // Consecutive circles, rects, and lines with the same state
+  DrawBatch batch;
+
+  // Path reused by polygons, polylines, and paths. Cleared rather than
+  // reallocated between calls
+  BLPath path_arena;
+
+  // Scratch space for decimating long polylines (if enabled)
+  Decimator decimator;
+
+  // Scratch buffer for converted rasters. Grows to fit the largest raster seen
+  std::vector<uint32_t> raster_buffer;
+  bool raster_pending = false;
+
   inline BLRgba32 convertColour(unsigned int col) {
     return BLRgba32(R_RED(col), R_GREEN(col), R_BLUE(col), R_ALPHA(col));
   }
@@ -125,20 +198,26 @@ private:
     return pattern;
   }
   inline void setColour(unsigned int col) {
+    if (stats) stats->state(STATE_COLOUR, col == col_cur);
     if (col != col_cur) {
+      flushBatch();
       context.setStrokeStyle(convertColour(col));
       col_cur = col;
     }
   }
   inline void setFill(unsigned int fill) {
+    if (stats) stats->state(STATE_FILL, fill == fill_cur);
     if (fill != fill_cur) {
+      flushBatch();
       context.setFillStyle(convertColour(fill));
       fill_cur = fill;
     }
   }
   // Must be called before setLinetype
   inline void setLinewidth(double lwd) {
+    if (stats) stats->state(STATE_LINEWIDTH, lwd == lwd_cur);
     if (lwd != lwd_cur) {
+      flushBatch();
       lwd_cur = lwd;
       lwd *= lwd_mod;
       context.setStrokeWidth(lwd);
@@ -146,62 +225,239 @@ private:
     }
   }
   inline void setLinetype(int lty) {
+    if (stats) stats->state(STATE_LINETYPE, lty == lty_cur);
     if (lty != lty_cur) {
+      flushBatch();
       context.setStrokeDashArray(convertLinetype(lty, lwd_cur));
       lty_cur = lty;
     }
   }
   inline void setLineend(R_GE_lineend lend) {
+    if (stats) stats->state(STATE_LINEEND, lend == lend_cur);
     if (lend != lend_cur) {
+      flushBatch();
       context.setStrokeCaps(convertLineend(lend));
       lend_cur = lend;
     }
   }
   inline void setLinejoin(R_GE_linejoin ljoin) {
+    if (stats) stats->state(STATE_LINEJOIN, ljoin == ljoin_cur);
     if (ljoin != ljoin_cur) {
+      flushBatch();
       context.setStrokeJoin(convertLinejoin(ljoin));
       ljoin_cur = ljoin;
     }
   }
   inline void setLinemitrelim(double lmitre) {
+    if (stats) stats->state(STATE_MITRE, lmitre == mitre_cur);
     if (lmitre != mitre_cur) {
+      flushBatch();
       context.setStrokeMiterLimit(lmitre);
       mitre_cur = lmitre;
     }
   }
-  void convertRasterBuffer(unsigned int* dest, unsigned int* src, int size) {
-    uint16_t r, g, b, a;
-    for (int i = 0; i < size; i++){
-      a = R_ALPHA(src[i]);
-      if (a == 0) {
-        dest[i] = 0;
-        continue;
-      }
-      r = R_RED(src[i]) * a;
-      r = (r + 1 + ((r + 1) >> 8)) >> 8;
-      g = R_GREEN(src[i]) * a;
-      g = (g + 1 + ((g + 1) >> 8)) >> 8;
-      b = R_BLUE(src[i]) * a;
-      b = (b + 1 + ((b + 1) >> 8)) >> 8;
-      dest[i] = ((b)|((g)<<8)|((r)<<16)|((a)<<24));
+  // Brings a newly started context in line with the cached state
+  inline void resetState() {
+    context.setStrokeStyle(convertColour(col_cur));
+    context.setFillStyle(convertColour(fill_cur));
+    context.setStrokeCaps(convertLineend(lend_cur));
+    context.setStrokeJoin(convertLinejoin(ljoin_cur));
+    lwd_cur = -1.0;
+    lty_cur = -2;
+    mitre_cur = -1.0;
+    clip_valid = false;
+  }
+  // Renders and clears the pending batch. Must be called before anything else
+  // is drawn or the context state is changed
+  inline void flushBatch() {
+    if (batch.empty()) return;
+    if (batch.fill) context.fillPath(batch.path);
+    if (batch.stroke) context.strokePath(batch.path);
+    batch.reset();
+  }
+  // Claims room in the batch for a shape with the given bounding box, flushing
+  // the current batch if needed. Returns false if the shape should be drawn
+  // directly
+  inline bool claimBatch(bool draw_fill, bool draw_stroke, double lwd,
+                         double x0, double y0, double x1, double y1) {
+    double pad = draw_stroke ? 0.5 * M_SQRT2 * lwd * lwd_mod : 0.0;
+    x0 -= pad;
+    y0 -= pad;
+    x1 += pad;
+    y1 += pad;
+    if (batch.claim(draw_fill, draw_stroke, x0, y0, x1, y1)) return true;
+    if (batch.empty()) return false;
+    flushBatch();
+    return batch.claim(draw_fill, draw_stroke, x0, y0, x1, y1);
+  }
+  /* Tests whether a shape with the given bounding box lies completely outside
+   * the clip rect. The box is expanded by the stroke (the mitre argument gives
+   * the maximum extent of joins and caps in multiples of half the line width)
+   * and a pixel of anti-aliasing. Shapes that are not culled are about to be
+   * drawn, so the pending clear is performed and the box is marked as dirty
+   */
+  inline bool culled(double x0, double y0, double x1, double y1, double lwd,
+                     double mitre = M_SQRT2) {
+    double pad = 0.5 * lwd * lwd_mod * mitre + 1.0;
+    if (x1 + pad < clip_left || x0 - pad > clip_right ||
+        y1 + pad < std::max(clip_top, (double) band_top) ||
+        y0 - pad > std::min(clip_bottom, (double) band_bottom)) {
+      return true;
+    }
+    if (clear_pending) applyClear();
+    markDirty(x0 - pad, y0 - pad, x1 + pad, y1 + pad);
+    return false;
+  }
+  inline bool culled(int n, const double* x, const double* y, double lwd,
+                     double mitre) {
+    if (n < 1) return true;
+    double x0 = x[0], x1 = x[0], y0 = y[0], y1 = y[0];
+    for (int i = 1; i < n; ++i) {
+      x0 = x[i] < x0 ? x[i] : x0;
+      x1 = x[i] > x1 ? x[i] : x1;
+      y0 = y[i] < y0 ? y[i] : y0;
+      y1 = y[i] > y1 ? y[i] : y1;
+    }
+    return culled(x0, y0, x1, y1, lwd, mitre);
+  }
+  // Adds the part of the box within the clip rect to the dirty box
+  inline void markDirty(double x0, double y0, double x1, double y1) {
+    int left = (int) std::floor(std::max(std::max(x0, clip_left), 0.0));
+    int top = (int) std::floor(std::max(std::max(y0, clip_top), 0.0));
+    int right = (int) std::ceil(std::min(std::min(x1, clip_right),
+                                         (double) width));
+    int bottom = (int) std::ceil(std::min(std::min(y1, clip_bottom),
+                                          (double) height));
+    if (right <= left || bottom <= top) return;
+    dirty.x0 = std::min(dirty.x0, left);
+    dirty.y0 = std::min(dirty.y0, top);
+    dirty.x1 = std::max(dirty.x1, right);
+    dirty.y1 = std::max(dirty.y1, bottom);
+  }
+  inline bool clipCoversPage() {
+    return clip_left <= 0.0 && clip_top <= 0.0 && clip_right >= width &&
+      clip_bottom >= height;
+  }
+  /* Clears the page to the pending background. The whole canvas is cleared if
+   * the background has changed, or the content of the canvas is unknown (then
+   * the dirty box covers it), and only the dirty box otherwise. The clip rect
+   * set for the page is lifted while clearing. Banded pages are always
+   * cleared in full as the canvas moves down the page
+   */
+  inline void applyClear() {
+    clear_pending = false;
+    bool full = band > 0 || pending_bg != clean_bg ||
+      (dirty.x0 <= 0 && dirty.y0 <= 0 && dirty.x1 >= width &&
+       dirty.y1 >= height);
+    if (!full && (dirty.x1 <= dirty.x0 || dirty.y1 <= dirty.y0)) return;
+    flushBatch();
+    bool clipped = !clipCoversPage();
+    if (clipped) context.restoreClipping();
+    context.setCompOp(BL_COMP_OP_SRC_COPY);
+    setFill(pending_bg);
+    if (full) {
+      context.fillAll();
+    } else {
+      context.fillBox(dirty);
+    }
+    context.setCompOp(BL_COMP_OP_SRC_OVER);
+    if (clipped) {
+      context.clipToRect(clip_left, clip_top, clip_right - clip_left,
+                         clip_bottom - clip_top);
+      clip_valid = true;
     }
+    clean_bg = pending_bg;
+    dirty = BLBoxI(width, height, 0, 0);
   }
+  inline bool pixelAligned(double v) {
+    return std::fabs(v - std::round(v)) < 1e-6;
+  }
+  /* Converts the box to an integer box if its edges are on pixel boundaries
+   * (or always when snapping is enabled). Returns false if the box is not
+   * aligned or would collapse when snapped
+   */
+  inline bool pixelBox(double x0, double y0, double x1, double y1,
+                       BLBoxI& box) {
+    if (!use_snapping && !(pixelAligned(x0) && pixelAligned(y0) &&
+                           pixelAligned(x1) && pixelAligned(y1))) {
+      return false;
+    }
+    box.x0 = (int) std::lround(std::min(x0, x1));
+    box.x1 = (int) std::lround(std::max(x0, x1));
+    box.y0 = (int) std::lround(std::min(y0, y1));
+    box.y1 = (int) std::lround(std::max(y0, y1));
+    return box.x1 > box.x0 && box.y1 > box.y0;
+  }
+  // Waits for the worker threads to finish all queued rendering commands.
+  // Only needed when the canvas (or memory referenced by the context) is about
+  // to be read or reused
+  inline void sync() {
+    if (threads > 0) {
+      context.flush(BL_CONTEXT_FLUSH_SYNC);
+    }
+    raster_pending = false;
+  }
+  static BLContextCreateInfo contextInfo(int threads) {
+    BLContextCreateInfo info;
+    info.reset();
+    info.threadCount = threads > 0 ? threads : 0;
+    return info;
+  }
+  static int canvasHeight(int h, int band) {
+    return band > 0 && band < h ? band : h;
+  }
+  // Devices providing the memory of their canvas attach it themselves, and
+  // pooled canvases are attached by the constructor
+  static BLImage createCanvas(int w, int h, uint32_t format,
+                              const InkOptions& options) {
+    if (options.mmap && options.band <= 0) return BLImage();
+    if (options.band <= 0 && get_device_pool().has(w, h, format)) {
+      return BLImage();
+    }
+    return BLImage(w, canvasHeight(h, options.band), format);
+  }
+  // Opaque devices draw without an alpha channel. Unless forced, a device is
+  // opaque if its background is
+  static uint32_t canvasFormat(int bg, const InkOptions& options) {
+    bool opaque = options.opaque < 0 ? R_OPAQUE(bg) : options.opaque > 0;
+    return opaque ? BL_FORMAT_XRGB32 : BL_FORMAT_PRGB32;
+  }
+  template<uint32_t Format>
+  SEXP capturePixels();
+  bool saveBands();
   const char* blresult_string(BLResult code);
 };
 
+// Fetches the InkDevice for a device number. Defined in device_info.cpp
+InkDevice* get_ink_device(SEXP which);
+
 // IMPLIMENTATION --------------------------------------------------------------
 
 // LIFECYCLE -------------------------------------------------------------------
 
 /* The initialiser takes care of setting up the buffer, and caching a pixel
- * formatter and renderer.
+ * formatter and renderer. If options.threads is larger than 0 the context
+ * will rasterise asynchronously using a pool of worker threads. If
+ * options.async is larger than 0 finished pages are encoded on a background
+ * thread with room for that many pages in the queue. If options.band is larger
+ * than 0 the canvas only holds that many rows and the page is rendered in
+ * bands (see saveBands()). Banded pages are always written synchronously. If
+ * options.mmap is set (and the page is not banded) no canvas is created, and
+ * the device must provide one with attachCanvas(). Otherwise the canvas and
+ * text renderer of a closed device of the same size are taken from the device
+ * pool if available, and handed back to it when the device is destroyed. The
+ * canvas is XRGB32 if the device is opaque (see canvasFormat()), and canvases
+ * provided by the device must use the same format.
  */
-InkDevice::InkDevice(const char* fp, int w, int h, double ps, int bg,
-                     double res, double scaling) :
-  canvas(w, h, BL_FORMAT_PRGB32),
-  context(canvas),
+inline InkDevice::InkDevice(const char* fp, int w, int h, double ps, int bg,
+                            double res, double scaling,
+                            const InkOptions& options) :
+  format(canvasFormat(bg, options)),
+  canvas(createCanvas(w, h, format, options)),
+  context(canvas, contextInfo(options.threads)),
   width(w),
   height(h),
+  threads(options.threads),
   pageno(0),
   file(fp),
   background_int(bg),
@@ -209,78 +465,298 @@ InkDevice::InkDevice(const char* fp, int w, int h, double ps, int bg,
   res_real(res),
   res_mod(scaling * res / 72.0),
   lwd_mod(scaling * res / 96.0),
-  text_renderer()
+  text_renderer(),
+  raster_cache(options.raster_cache),
+  sprite_cache(),
+  use_sprites(options.sprites),
+  use_decimation(options.decimate),
+  use_snapping(options.snap),
+  recording(options.record || options.band > 0),
+  display_list(w, h),
+  band(options.band > 0 ? options.band : 0),
+  stats(options.stats ? new DeviceStats() : NULL),
+  band_top(0),
+  band_bottom(canvasHeight(h, options.band)),
+  owns_canvas(!options.mmap && options.band <= 0),
+  dirty(0, 0, w, h),
+  batch(w, h)
 {
+  if (owns_canvas) {
+    DevicePool::Backend backend;
+    if (get_device_pool().take(w, h, format, backend)) {
+      attachCanvas(backend.canvas);
+      text_renderer = std::move(backend.text_renderer);
+      text_renderer.reset_counters();
+    }
+  }
+  if (band > 0) {
+    can_capture = false;
+  } else if (options.async > 0 && !options.mmap) {
+    encoder.reset(new PageEncoder(
+      [this](const BLImage& image, int page) {
+        PhaseTimer timer(stats.get(), PHASE_WRITE, page);
+        return writePage(image, page);
+      },
+      options.async, w, h, format
+    ));
+  }
   newPage(bg, false);
 }
-InkDevice::~InkDevice() {
+inline InkDevice::~InkDevice() {
   context.end();
+  if (owns_canvas && !canvas.empty()) {
+    DevicePool::Backend backend;
+    backend.canvas = std::move(canvas);
+    backend.text_renderer = std::move(text_renderer);
+    get_device_pool().put(backend);
+  }
 }
 /* newPage() should not need to be overwritten as long the class have an
  * appropriate savePage() method. For scrren devices it may make sense to change
  * it for performance
  */
-void InkDevice::newPage(unsigned int bg, bool increase_pageno) {
+inline void InkDevice::newPage(unsigned int bg, bool increase_pageno) {
   if (pageno != 0) {
-    if (!savePage()) {
+    if (!finishPage(false)) {
       Rf_warning("ink could not write to the given file");
     }
   }
 
-  clipRect(0, 0, width, height);
-  context.setCompOp(BL_COMP_OP_SRC_COPY);
-  if (visibleColour(bg)) {
-    setFill(bg);
-  } else {
-    setFill(background_int);
-  }
-  context.fillAll();
-  context.setCompOp(BL_COMP_OP_SRC_OVER);
+  clearPage(bg);
 
   if (increase_pageno) pageno++;
 }
-void InkDevice::close() {
+/* Clears the current page to the given background (or the device background
+ * if transparent). This also starts a new recording if the device records
+ * its display list. The canvas itself is cleared once the page is first drawn
+ * on or finished (see applyClear())
+ */
+inline void InkDevice::clearPage(unsigned int bg) {
+  if (!visibleColour(bg)) {
+    bg = background_int;
+  }
+  if (recording) {
+    display_list.clear();
+    display_list.page(bg);
+  }
+  flushBatch();
+  clipRect(0, 0, width, height);
+  pending_bg = bg;
+  clear_pending = true;
+  if (band > 0) applyClear();
+}
+inline void InkDevice::close() {
   if (pageno == 0) pageno++;
-  if (!savePage()) {
+  if (!finishPage(true)) {
     Rf_warning("ink could not write to the given file");
   }
 }
 
-SEXP InkDevice::capture() {
-  // TODO
-  return Rf_allocVector(INTSXP, 0);
+/* Returns the current page as a native raster (an integer matrix in R's
+ * non-premultiplied ABGR layout)
+ */
+inline SEXP InkDevice::capture() {
+  flushBatch();
+  if (clear_pending) applyClear();
+  sync();
+  if (format == BL_FORMAT_XRGB32) {
+    return capturePixels<BL_FORMAT_XRGB32>();
+  }
+  return capturePixels<BL_FORMAT_PRGB32>();
+}
+template<uint32_t Format>
+inline SEXP InkDevice::capturePixels() {
+  SEXP raster = PROTECT(Rf_allocVector(INTSXP, (R_xlen_t) width * height));
+  uint32_t* dest = (uint32_t*) INTEGER(raster);
+  BLImageData data;
+  canvas.getData(&data);
+  const uint8_t* pixels = (const uint8_t*) data.pixelData;
+  if (data.stride == (intptr_t) width * 4) {
+    PixelFormat<Format>::to_native(dest, (const uint32_t*) pixels,
+                                   (size_t) width * height);
+  } else {
+    for (int y = 0; y < height; ++y) {
+      PixelFormat<Format>::to_native(
+        dest + (size_t) y * width,
+        (const uint32_t*) (pixels + data.stride * y), width
+      );
+    }
+  }
+  SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(dims)[0] = height;
+  INTEGER(dims)[1] = width;
+  Rf_setAttrib(raster, R_DimSymbol, dims);
+  UNPROTECT(2);
+  return raster;
+}
+
+/* Renders a recorded display list onto the current page, scaling the geometry
+ * to the size of this device. Line widths and font sizes are not scaled by
+ * the size ratio, but by the resolution and scaling of this device as usual
+ */
+inline void InkDevice::replay(const DisplayList& list) {
+  if (list.width <= 0 || list.height <= 0) return;
+  if (&list == &display_list) {
+    // Replaying restarts the recording so work on a copy
+    DisplayList copy(list);
+    replay(copy);
+    return;
+  }
+  list.replay(*this, (double) width / list.width,
+              (double) height / list.height);
+}
+
+/* Replaces the canvas with image, e.g. one created on top of memory provided
+ * by the device, and restarts the context on it. image is left empty
+ */
+inline void InkDevice::attachCanvas(BLImage& image) {
+  detachCanvas();
+  canvas = std::move(image);
+  context.begin(canvas, contextInfo(threads));
+  resetState();
+  dirty = BLBoxI(0, 0, width, height);
+}
+/* Waits for all rendering to finish and releases the canvas, so the memory
+ * behind it can be freed by the device
+ */
+inline void InkDevice::detachCanvas() {
+  flushBatch();
+  sync();
+  context.end();
+  canvas.reset();
+}
+
+/* Hands the finished page over for saving. In async mode the canvas is queued
+ * for the encoder and drawing continues on a recycled canvas. Failures from
+ * earlier queued pages are reported when the next page is finished and when
+ * the last page has been drained.
+ */
+inline bool InkDevice::finishPage(bool last) {
+  flushBatch();
+  if (clear_pending) applyClear();
+  if (band > 0 || !encoder) {
+    {
+      PhaseTimer timer(stats.get(), PHASE_SYNC, pageno);
+      sync();
+    }
+    PhaseTimer timer(stats.get(), PHASE_SAVE, pageno);
+    return band > 0 ? saveBands() : savePage();
+  }
+  PhaseTimer timer(stats.get(), PHASE_QUEUE, pageno);
+  context.end();
+  encoder->push(canvas, pageno);
+  if (last) {
+    encoder->drain();
+  } else {
+    // Recycled canvases hold an older page
+    canvas = encoder->acquire();
+    context.begin(canvas, contextInfo(threads));
+    resetState();
+    dirty = BLBoxI(0, 0, width, height);
+  }
+  return encoder->take_failures() == 0;
+}
+
+/* This takes care of saving the current canvas. The default is to pass it on
+ * to writePage(), but devices not writing to a file may want to overwrite it.
+ * Any pending asynchronous rendering has finished before this is called.
+ */
+inline bool InkDevice::savePage() {
+  return writePage(canvas, pageno);
 }
 
 /* This takes care of writing the BLImage to an appropriate file. The filename
  * may be specified as a printf string with room for a page counter, so the
- * method should take care of resolving that together with the pageno field.
+ * method should take care of resolving that together with the page argument.
+ * In async mode this is called from the encoder thread so it must not call
+ * into R.
+ */
+inline bool InkDevice::writePage(const BLImage& image, int page) {
+  return true;
+}
+
+/* Banded pages are written through these methods instead of writePage(). The
+ * page is opened with beginBands(), after which writeBand() is called with the
+ * canvas for each band from the top of the page (only the first rows rows of
+ * the last band belong to the page), and endBands() is always called last.
+ * Devices that cannot write pages in parts should keep the default which
+ * fails.
  */
-bool InkDevice::savePage() {
+inline bool InkDevice::beginBands(int page) {
+  return false;
+}
+inline bool InkDevice::writeBand(const BLImage& image, int rows) {
+  return false;
+}
+inline bool InkDevice::endBands() {
   return true;
 }
 
+/* Writes the page in horizontal bands. The top band is rendered as the page is
+ * drawn, while the remaining bands are rendered by replaying the display list
+ * of the page with the canvas moved down the page. The offset is applied as
+ * the meta matrix of the context so the drawing code sees the same
+ * coordinates, and thus produces the same pixels, as on a full size canvas
+ */
+inline bool InkDevice::saveBands() {
+  bool success = beginBands(pageno) &&
+    writeBand(canvas, std::min(band, height));
+  recording = false;
+  // The saved state must be unclipped, as restoreClipping() in clipRect() and
+  // applyClear() returns to it
+  context.restoreClipping();
+  for (int top = band; success && top < height; top += band) {
+    context.save();
+    context.translate(0, -top);
+    context.userToMeta();
+    band_top = top;
+    band_bottom = top + band;
+    clip_valid = false;
+    display_list.replay(*this, 1.0, 1.0);
+    flushBatch();
+    context.restore();
+    resetState();
+    sync();
+    success = writeBand(canvas, std::min(band, height - top));
+  }
+  recording = true;
+  band_top = 0;
+  band_bottom = band;
+  return endBands() && success;
+}
+
 
 // BEHAVIOUR -------------------------------------------------------------------
 
 /* The clipRect method sets clipping on the context. Clipping is cumulative in
- * B2D so need to reset first
+ * B2D so need to reset first. grid resets the clipping on almost every
+ * viewport change so nothing is done if the rect is unchanged
  */
-void InkDevice::clipRect(double x0, double y0, double x1, double y1) {
-  clip_left = x0;
-  clip_right = x1;
-  clip_top = y0;
-  clip_bottom = y1;
-  double width = x1 - x0;
-  double height = y1 - y0;
+inline void InkDevice::clipRect(double x0, double y0, double x1, double y1) {
+  if (recording) display_list.clip(x0, y0, x1, y1);
+  double left = std::min(x0, x1);
+  double right = std::max(x0, x1);
+  double top = std::min(y0, y1);
+  double bottom = std::max(y0, y1);
+  if (clip_valid && left == clip_left && right == clip_right &&
+      top == clip_top && bottom == clip_bottom) {
+    return;
+  }
+  flushBatch();
+  clip_left = left;
+  clip_right = right;
+  clip_top = top;
+  clip_bottom = bottom;
   context.restoreClipping();
-  context.clipToRect(x0, y0, width, height);
+  context.clipToRect(left, top, right - left, bottom - top);
+  clip_valid = true;
 }
 
 /* These methods funnel all operations to the text_renderer. See text_renderer.h
  * for implementation details.
  */
-double InkDevice::stringWidth(const char *str, const char *family, int face,
-                              double size) {
+inline double InkDevice::stringWidth(const char *str, const char *family,
+                                     int face, double size) {
   BLResult err = text_renderer.load_font(family, face, size * res_mod);
   if (err != BL_SUCCESS) {
     Rf_warning("ink failed to load font: '%s' (%s)", family, blresult_string(err));
@@ -288,8 +764,9 @@ double InkDevice::stringWidth(const char *str, const char *family, int face,
   }
   return text_renderer.get_text_width(str);
 }
-void InkDevice::charMetric(int c, const char *family, int face, double size,
-                           double *ascent, double *descent, double *width) {
+inline void InkDevice::charMetric(int c, const char *family, int face,
+                                  double size, double *ascent, double *descent,
+                                  double *width) {
   if (c < 0) {
     c = -c;
   }
@@ -309,10 +786,13 @@ void InkDevice::charMetric(int c, const char *family, int face, double size,
 // DRAWING ---------------------------------------------------------------------
 
 /* Draws a circle. Used for standard points as well as grid.circle etc.
- * Can we simplify for small radius?
+ * Small circles with a solid stroke are stamped from the sprite cache.
  */
-void InkDevice::drawCircle(double x, double y, double r, int fill, int col,
-                           double lwd, int lty, R_GE_lineend lend) {
+inline void InkDevice::drawCircle(double x, double y, double r, int fill,
+                                  int col, double lwd, int lty,
+                                  R_GE_lineend lend) {
+  if (recording) display_list.circle(x, y, r, fill, col, lwd, lty, lend);
+
   bool draw_fill = visibleColour(fill);
   bool draw_stroke = visibleColour(col) && lwd > 0.0 && lty != LTY_BLANK;
 
@@ -320,32 +800,94 @@ void InkDevice::drawCircle(double x, double y, double r, int fill, int col,
 
   r = r < 0.5 ? 0.5 : r;
 
+  if (culled(x - r, y - r, x + r, y + r, draw_stroke ? lwd : 0.0)) return;
+
+  if (use_sprites && (!draw_stroke || lty == LTY_SOLID)) {
+    BLImage sprite;
+    BLPointI pos;
+    if (sprite_cache.circle(x, y, r, draw_fill ? fill : 0,
+                            draw_stroke ? col : 0, lwd * lwd_mod, sprite,
+                            pos)) {
+      flushBatch();
+      context.blitImage(pos, sprite);
+      return;
+    }
+  }
+
   BLCircle circle(x, y, r);
   if (draw_fill) {
     setFill(fill);
-    context.fillCircle(circle);
   }
   if (draw_stroke) {
     setColour(col);
     setLinewidth(lwd);
     setLineend(lend);
     setLinetype(lty);
-    context.strokeCircle(circle);
   }
+  if ((!draw_stroke || lty == LTY_SOLID) &&
+      claimBatch(draw_fill, draw_stroke, lwd, x - r, y - r, x + r, y + r)) {
+    batch.path.addCircle(circle);
+    return;
+  }
+  flushBatch();
+  if (draw_fill) context.fillCircle(circle);
+  if (draw_stroke) context.strokeCircle(circle);
 }
 
-void InkDevice::drawRect(double x0, double y0, double x1, double y1, int fill,
-                         int col, double lwd, int lty, R_GE_lineend lend) {
+inline void InkDevice::drawRect(double x0, double y0, double x1, double y1,
+                                int fill, int col, double lwd, int lty,
+                                R_GE_lineend lend) {
+  if (recording) {
+    display_list.rect(x0, y0, x1, y1, fill, col, lwd, lty, lend);
+  }
+
   bool draw_fill = visibleColour(fill);
   bool draw_stroke = visibleColour(col) && lwd > 0.0 && lty != LTY_BLANK;
 
   if (!draw_fill && !draw_stroke) return; // Early exit
 
+  // An opaque fill covering the page first thing stands in for its background
+  if (clear_pending && draw_fill && R_ALPHA(fill) == 255 && clipCoversPage() &&
+      std::min(x0, x1) <= 0.0 && std::min(y0, y1) <= 0.0 &&
+      std::max(x0, x1) >= width && std::max(y0, y1) >= height) {
+    pending_bg = fill;
+    applyClear();
+    if (!draw_stroke) return;
+    draw_fill = false;
+  }
+
+  if (culled(std::min(x0, x1), std::min(y0, y1), std::max(x0, x1),
+             std::max(y0, y1), draw_stroke ? lwd : 0.0)) {
+    return;
+  }
+
+  // Fills on pixel boundaries need no coverage calculations
+  BLBoxI pixel_box;
+  if (draw_fill && pixelBox(x0, y0, x1, y1, pixel_box)) {
+    flushBatch();
+    setFill(fill);
+    context.fillBox(pixel_box);
+    if (!draw_stroke) return;
+    draw_fill = false;
+  }
+
+  // Small rects (e.g. square points) are stamped from the sprite cache
+  if (use_sprites && (!draw_stroke || lty == LTY_SOLID)) {
+    BLImage sprite;
+    BLPointI pos;
+    if (sprite_cache.rect(std::min(x0, x1), std::min(y0, y1),
+                          std::fabs(x1 - x0), std::fabs(y1 - y0),
+                          draw_fill ? fill : 0, draw_stroke ? col : 0,
+                          lwd * lwd_mod, sprite, pos)) {
+      flushBatch();
+      context.blitImage(pos, sprite);
+      return;
+    }
+  }
+
   BLBox rect(x0, y0, x1, y1);
   if (draw_fill) {
-    // TODO: Pixel align fill
     setFill(fill);
-    context.fillBox(rect);
   }
   if (draw_stroke) {
     setColour(col);
@@ -354,25 +896,41 @@ void InkDevice::drawRect(double x0, double y0, double x1, double y1, int fill,
     setLinejoin(GE_MITRE_JOIN);
     setLinemitrelim(5);
     setLinetype(lty);
-    context.strokeBox(rect);
   }
+  if ((!draw_stroke || lty == LTY_SOLID) &&
+      claimBatch(draw_fill, draw_stroke, lwd, std::min(x0, x1),
+                 std::min(y0, y1), std::max(x0, x1), std::max(y0, y1))) {
+    batch.path.addBox(rect);
+    return;
+  }
+  flushBatch();
+  if (draw_fill) context.fillBox(rect);
+  if (draw_stroke) context.strokeBox(rect);
 }
 
-void InkDevice::drawPolygon(int n, double *x, double *y, int fill, int col,
-                            double lwd, int lty, R_GE_lineend lend,
-                            R_GE_linejoin ljoin, double lmitre) {
+inline void InkDevice::drawPolygon(int n, double *x, double *y, int fill,
+                                   int col, double lwd, int lty,
+                                   R_GE_lineend lend, R_GE_linejoin ljoin,
+                                   double lmitre) {
+  if (recording) {
+    display_list.polygon(n, x, y, fill, col, lwd, lty, lend, ljoin, lmitre);
+  }
+
   bool draw_fill = visibleColour(fill);
   bool draw_stroke = visibleColour(col) && lwd > 0.0 && lty != LTY_BLANK;
 
   if (n < 2 || (!draw_fill && !draw_stroke)) return; // Early exit
 
-  BLPath poly;
-  poly.reserve(n + 1);
-  poly.moveTo(x[0], y[0]);
-  for (int i = 1; i < n; i++) {
-    poly.lineTo(x[i], y[i]);
+  if (culled(n, x, y, draw_stroke ? lwd : 0.0,
+             std::max(lmitre, M_SQRT2))) {
+    return;
   }
-  poly.close();
+
+  flushBatch();
+
+  BLPath& poly = path_arena;
+  poly.clear();
+  append_polyline(poly, n, x, y, true);
 
   if (draw_fill) {
     setFill(fill);
@@ -389,31 +947,60 @@ void InkDevice::drawPolygon(int n, double *x, double *y, int fill, int col,
   }
 }
 
-void InkDevice::drawLine(double x1, double y1, double x2, double y2, int col,
-                         double lwd, int lty, R_GE_lineend lend) {
+inline void InkDevice::drawLine(double x1, double y1, double x2, double y2,
+                                int col, double lwd, int lty,
+                                R_GE_lineend lend) {
+  if (recording) display_list.line(x1, y1, x2, y2, col, lwd, lty, lend);
+
   if (!visibleColour(col) || lwd == 0.0 || lty == LTY_BLANK) return;
 
+  if (culled(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2),
+             std::max(y1, y2), lwd)) {
+    return;
+  }
+
   BLLine line(x1, y1, x2, y2);
 
   setColour(col);
   setLinewidth(lwd);
   setLineend(lend);
   setLinetype(lty);
+  if (lty == LTY_SOLID &&
+      claimBatch(false, true, lwd, std::min(x1, x2), std::min(y1, y2),
+                 std::max(x1, x2), std::max(y1, y2))) {
+    batch.path.addLine(line);
+    return;
+  }
+  flushBatch();
   context.strokeLine(line);
 }
 
-void InkDevice::drawPolyline(int n, double* x, double* y, int col, double lwd,
-                             int lty, R_GE_lineend lend, R_GE_linejoin ljoin,
-                             double lmitre) {
+inline void InkDevice::drawPolyline(int n, double* x, double* y, int col,
+                                    double lwd, int lty, R_GE_lineend lend,
+                                    R_GE_linejoin ljoin, double lmitre) {
+  if (recording) {
+    display_list.polyline(n, x, y, col, lwd, lty, lend, ljoin, lmitre);
+  }
+
   if (!visibleColour(col) || lwd == 0.0 || lty == LTY_BLANK || n < 2) return;
 
-  BLPath poly;
-  poly.reserve(n);
-  poly.moveTo(x[0], y[0]);
-  for (int i = 1; i < n; i++) {
-    poly.lineTo(x[i], y[i]);
+  if (culled(n, x, y, lwd, std::max(lmitre, M_SQRT2))) return;
+
+  flushBatch();
+
+  // Dropping vertices would shift the phase of dashes
+  int n_decimated = use_decimation && lty == LTY_SOLID ?
+    decimator.run(n, x, y) : 0;
+  if (n_decimated > 0) {
+    n = n_decimated;
+    x = decimator.x.data();
+    y = decimator.y.data();
   }
 
+  BLPath& poly = path_arena;
+  poly.clear();
+  append_polyline(poly, n, x, y);
+
   setColour(col);
   setLinewidth(lwd);
   setLineend(lend);
@@ -423,9 +1010,15 @@ void InkDevice::drawPolyline(int n, double* x, double* y, int col, double lwd,
   context.strokePath(poly);
 }
 
-void InkDevice::drawPath(int npoly, int* nper, double* x, double* y, int col,
-                         int fill, double lwd, int lty, R_GE_lineend lend,
-                         R_GE_linejoin ljoin, double lmitre, bool evenodd) {
+inline void InkDevice::drawPath(int npoly, int* nper, double* x, double* y,
+                                int col, int fill, double lwd, int lty,
+                                R_GE_lineend lend, R_GE_linejoin ljoin,
+                                double lmitre, bool evenodd) {
+  if (recording) {
+    display_list.path(npoly, nper, x, y, col, fill, lwd, lty, lend, ljoin,
+                      lmitre, evenodd);
+  }
+
   bool draw_fill = visibleColour(fill);
   bool draw_stroke = visibleColour(col) && lwd > 0.0 && lty != LTY_BLANK;
 
@@ -433,20 +1026,39 @@ void InkDevice::drawPath(int npoly, int* nper, double* x, double* y, int col,
 
   lwd *= lwd_mod;
 
-  BLPath path;
+  int n_total = 0;
+  for (int i = 0; i < npoly; i++) {
+    n_total += nper[i];
+  }
+  if (culled(n_total, x, y, draw_stroke ? lwd : 0.0,
+             std::max(lmitre, M_SQRT2))) {
+    return;
+  }
+
+  flushBatch();
+
+  BLPath& path = path_arena;
+  path.clear();
+  path.reserve(n_total + npoly);
   int counter = 0;
   for (int i = 0; i < npoly; i++) {
     if (nper[i] < 2) {
       counter += nper[i];
       continue;
     }
-    path.moveTo(x[counter], y[counter]);
-    counter++;
-    for (int j = 1; j < nper[i]; j++) {
-      path.lineTo(x[counter], y[counter]);
-      counter++;
-    };
-    path.close();
+    int n = nper[i];
+    double* sub_x = x + counter;
+    double* sub_y = y + counter;
+    counter += n;
+    // Fills are not decimated as that would change their coverage
+    int n_decimated = use_decimation && !draw_fill && lty == LTY_SOLID ?
+      decimator.run(n, sub_x, sub_y) : 0;
+    if (n_decimated > 0) {
+      n = n_decimated;
+      sub_x = decimator.x.data();
+      sub_y = decimator.y.data();
+    }
+    append_polyline(path, n, sub_x, sub_y, true);
   }
 
   if (draw_fill) {
@@ -464,17 +1076,56 @@ void InkDevice::drawPath(int npoly, int* nper, double* x, double* y, int col,
   }
 }
 
-void InkDevice::drawRaster(unsigned int *raster, int w, int h, double x,
-                           double y, double final_width, double final_height,
-                           double rot, bool interpolate) {
-  unsigned int * buffer = new unsigned int[w * h];
-  convertRasterBuffer(buffer, raster, w * h);
+inline void InkDevice::drawRaster(unsigned int *raster, int w, int h, double x,
+                                  double y, double final_width,
+                                  double final_height, double rot,
+                                  bool interpolate) {
+  if (recording) {
+    display_list.raster(raster, w, h, x, y, final_width, final_height, rot,
+                        interpolate);
+  }
+
+  // Rotated rasters stay within their diagonal of the rotation point
+  double reach = std::fabs(final_width) + std::fabs(final_height);
+  if (rot == 0.0 ?
+      culled(std::min(x, x + final_width), std::min(y, y + final_height),
+             std::max(x, x + final_width), std::max(y, y + final_height),
+             0.0) :
+      culled(x - reach, y - reach, x + reach, y + reach, 0.0)) {
+    return;
+  }
+
+  flushBatch();
+
   BLImage raster_image;
-  BLResult err = raster_image.createFromData(w, h, BL_FORMAT_PRGB32, buffer, w * 4);
-  if (err != BL_SUCCESS) {
-    Rf_warning("Failed to mount raster with: %s", blresult_string(err));
+  if (!raster_cache.lookup(raster, w, h, raster_image)) {
+    // Worker threads may still be reading the previous raster from the buffer
+    if (raster_pending) sync();
+
+    size_t n = (size_t) w * h;
+    if (raster_buffer.size() < n) {
+      raster_buffer.resize(n);
+    }
+    premultiply_native(raster_buffer.data(), raster, n);
+    BLResult err = raster_image.createFromData(w, h, BL_FORMAT_PRGB32,
+                                               raster_buffer.data(), w * 4);
+    if (err != BL_SUCCESS) {
+      Rf_warning("Failed to mount raster with: %s", blresult_string(err));
+      return;
+    }
+    raster_pending = threads > 0;
+  }
+
+  // Unscaled, unrotated, and pixel aligned rasters can be copied directly
+  double top = y + final_height;
+  if (rot == 0.0 && std::fabs(final_width - w) < 1e-6 &&
+      std::fabs(final_height + h) < 1e-6 && pixelAligned(x) &&
+      pixelAligned(top)) {
+    context.blitImage(BLPointI(std::lround(x), std::lround(top)),
+                      raster_image);
     return;
   }
+
   BLPattern raster_fill(raster_image, BL_EXTEND_MODE_PAD);
   raster_fill.translate(x, y + final_height);
   raster_fill.scale(final_width / (double) w, - final_height / (double) h);
@@ -485,25 +1136,30 @@ void InkDevice::drawRaster(unsigned int *raster, int w, int h, double x,
 
   // Reset context
   context.resetMatrix();
-  context.setFillStyle(convertColour(col_cur));
-
-  raster_image.reset();
-  delete[] buffer;
+  context.setFillStyle(convertColour(fill_cur));
 }
 
-void InkDevice::drawText(double x, double y, const char *str,
-                         const char *family, int face, double size, double rot,
-                         double hadj, int col) {
+inline void InkDevice::drawText(double x, double y, const char *str,
+                                const char *family, int face, double size,
+                                double rot, double hadj, int col) {
+  if (recording) {
+    display_list.text(x, y, str, family, face, size, rot, hadj, col);
+  }
+
   BLResult err = text_renderer.load_font(family, face, size * res_mod);
   if (err != BL_SUCCESS) {
     Rf_warning("ink failed to load font: '%s' (%i: %s)", family, err, blresult_string(err));
     return;
   }
+  // Glyphs stay within an em or two of the run, whatever the rotation
+  double reach = text_renderer.get_text_width(str) + 2 * size * res_mod;
+  if (culled(x - reach, y - reach, x + reach, y + reach, 0.0)) return;
+  flushBatch();
   setFill(col);
   text_renderer.plot_text(x, y, str, rot, hadj, context);
 }
 
-const char * InkDevice::blresult_string(BLResult code) {
+inline const char * InkDevice::blresult_string(BLResult code) {
   switch (code) {
   case BL_ERROR_OUT_OF_MEMORY: return "Out of memory [ENOMEM].";
   case BL_ERROR_INVALID_VALUE: return "Invalid value/argument [EINVAL].";
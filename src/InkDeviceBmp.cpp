@@ -1,29 +1,94 @@
 #include "ink.h"
 #include "InkDevice.h"
+#include "BmpWriter.h"
 #include "init_device.h"
 
+/* In mmap mode every page is drawn directly into its own file, mapped into
+ * memory as a top-down BMP. The file of the next page is mapped as soon as the
+ * previous page is finished
+ */
 class InkDeviceBmp : public InkDevice {
+  BmpWriter writer;
+  MappedBmp mapping;
+  bool mapped;
+
 public:
   InkDeviceBmp(const char* fp, int w, int h, double ps, int bg, double res,
-               double scaling) :
-  InkDevice(fp, w, h, ps, bg, res, scaling)
+               double scaling, const InkOptions& options) :
+  InkDevice(fp, w, h, ps, bg, res, scaling, options),
+  writer(res),
+  mapping(res),
+  mapped(options.mmap && options.band <= 0)
   {
-
+    if (mapped) {
+      mapPage(1);
+      clearPage(bg);
+    }
+  }
+  // Lifecycle
+  void newPage(unsigned int bg, bool increase_pageno = true) {
+    if (!mapped || pageno == 0) {
+      InkDevice::newPage(bg, increase_pageno);
+      return;
+    }
+    if (!finishPage(false)) {
+      Rf_warning("ink could not write to the given file");
+    }
+    mapPage(pageno + 1);
+    clearPage(bg);
+    if (increase_pageno) pageno++;
   }
-  // Behaviour
   bool savePage() {
+    if (!mapped) {
+      return InkDevice::savePage();
+    }
+    detachCanvas();
+    return mapping.finish();
+  }
+  // Behaviour
+  bool writePage(const BLImage& image, int page) {
     char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    BLImageCodec codec;
-    codec.findByName("BMP");
-    BLResult res = canvas.writeToFile(buf, codec);
-    return res == BL_SUCCESS;
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    return writer.write(image, buf);
   };
+  bool beginBands(int page) {
+    char buf[PATH_MAX+1];
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    return writer.begin(buf, width, height, format);
+  };
+  bool writeBand(const BLImage& image, int rows) {
+    return writer.write_rows(image, rows);
+  };
+  bool endBands() {
+    return writer.end();
+  };
+
+private:
+  /* Creates the canvas on top of the mapped file of the given page. If the file
+   * cannot be mapped the device falls back to writing pages from memory
+   */
+  void mapPage(int page) {
+    char buf[PATH_MAX+1];
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    BLImage image;
+    uint32_t* pixels = mapping.open(buf, width, height, format);
+    if (pixels != NULL &&
+        image.createFromData(width, height, format, pixels,
+                             4 * (intptr_t) width) == BL_SUCCESS) {
+      attachCanvas(image);
+      return;
+    }
+    mapping.close();
+    mapped = false;
+    Rf_warning("ink could not map '%s' to memory. Writing pages normally", buf);
+    image.create(width, height, format);
+    attachCanvas(image);
+  }
 };
 
 // [[export]]
 SEXP ink_bmp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
-               SEXP res, SEXP scaling) {
+               SEXP res, SEXP scaling, SEXP options) {
   int bgCol = RGBpar(bg, 0);
   InkDeviceBmp* device = new InkDeviceBmp(
     CHAR(STRING_ELT(file, 0)),
@@ -32,7 +97,8 @@ SEXP ink_bmp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
     REAL(pointsize)[0],
     bgCol,
     REAL(res)[0],
-    REAL(scaling)[0]
+    REAL(scaling)[0],
+    read_options(options)
   );
   makeInkDevice<InkDeviceBmp>(device, "ink_bmp");
 
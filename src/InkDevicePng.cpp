@@ -0,0 +1,58 @@
+#include "ink.h"
+#include "InkDevice.h"
+#include "PngEncoder.h"
+#include "init_device.h"
+
+class InkDevicePng : public InkDevice {
+  PngEncoder encoder;
+
+public:
+  InkDevicePng(const char* fp, int w, int h, double ps, int bg, double res,
+               double scaling, const InkOptions& options, int compression,
+               int filter, int deflate_threads) :
+  InkDevice(fp, w, h, ps, bg, res, scaling, options),
+  encoder(compression, filter, deflate_threads, res)
+  {
+
+  }
+  // Behaviour
+  bool writePage(const BLImage& image, int page) {
+    char buf[PATH_MAX+1];
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    return encoder.write(image, buf);
+  };
+  bool beginBands(int page) {
+    char buf[PATH_MAX+1];
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    return encoder.begin(buf, width, height, format);
+  };
+  bool writeBand(const BLImage& image, int rows) {
+    return encoder.write_rows(image, rows);
+  };
+  bool endBands() {
+    return encoder.end();
+  };
+};
+
+// [[export]]
+SEXP ink_png_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP options, SEXP compression,
+               SEXP filter, SEXP deflate_threads) {
+  int bgCol = RGBpar(bg, 0);
+  InkDevicePng* device = new InkDevicePng(
+    CHAR(STRING_ELT(file, 0)),
+    INTEGER(width)[0],
+    INTEGER(height)[0],
+    REAL(pointsize)[0],
+    bgCol,
+    REAL(res)[0],
+    REAL(scaling)[0],
+    read_options(options),
+    INTEGER(compression)[0],
+    INTEGER(filter)[0],
+    INTEGER(deflate_threads)[0]
+  );
+  makeInkDevice<InkDevicePng>(device, "ink_png");
+
+  return R_NilValue;
+}
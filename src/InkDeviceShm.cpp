@@ -0,0 +1,220 @@
+#include "ink.h"
+#include "InkDevice.h"
+#include "init_device.h"
+
+#include <ink_shm.h>
+#include <string>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// POSIX shared memory names must start with a slash
+static std::string shm_path(const char* name) {
+  return name[0] == '/' ? std::string(name) : "/" + std::string(name);
+}
+
+/* Device drawing into a ring of canvases in POSIX shared memory (see
+ * inst/include/ink_shm.h for the layout and read protocol). Every finished
+ * page is published by marking its slot as complete and pointing the header
+ * to it, after which drawing continues in the next slot. The device never
+ * waits for readers. The segment is removed when the device is closed.
+ */
+class InkDeviceShm : public InkDevice {
+  std::string name;
+  InkShmHeader* header = NULL;
+  size_t size = 0;
+  uint32_t slot = 0;
+  uint64_t frame = 0;
+
+public:
+  InkDeviceShm(const char* fp, int w, int h, double ps, int bg, double res,
+               double scaling, const InkOptions& options) :
+  InkDevice(fp, w, h, ps, bg, res, scaling, options),
+  name(shm_path(fp))
+  {
+
+  }
+  ~InkDeviceShm() {
+    detachCanvas();
+#if !defined _WIN32
+    if (header != NULL) {
+      munmap(header, size);
+      shm_unlink(name.c_str());
+    }
+#endif
+  }
+
+  /* Creates the segment with n_slots canvases and starts drawing in the first.
+   * Fails if a segment with the same name already exists
+   */
+  bool open(int n_slots) {
+#if defined _WIN32
+    return false;
+#else
+    if (n_slots < 1 || n_slots > INK_SHM_MAX_SLOTS) return false;
+    size_t stride = 4 * (size_t) width;
+    size_t slot_size = (stride * height + 63) & ~((size_t) 63);
+    size_t data_offset = (sizeof(InkShmHeader) + 4095) & ~((size_t) 4095);
+    size = data_offset + slot_size * n_slots;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    void* addr = MAP_FAILED;
+    if (ftruncate(fd, (off_t) size) == 0) {
+      addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+    header = (InkShmHeader*) addr;
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->n_slots = n_slots;
+    header->data_offset = data_offset;
+    header->slot_size = slot_size;
+    header->version = INK_SHM_VERSION;
+    __atomic_store_n(&header->magic, INK_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    beginSlot(0);
+    return true;
+#endif
+  }
+  // Lifecycle
+  void close() {
+    InkDevice::close();
+    if (header != NULL) {
+      __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+    }
+  }
+  bool savePage() {
+    if (header == NULL) return false;
+    // Rendering has finished so the page can be published
+    InkShmSlot& current = header->slots[slot];
+    __atomic_store_n(&current.frame, ++frame, __ATOMIC_RELAXED);
+    __atomic_store_n(&current.seq, current.seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, slot, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame, frame, __ATOMIC_RELEASE);
+
+    beginSlot((slot + 1) % header->n_slots);
+    return true;
+  }
+
+private:
+  // Marks the slot as being drawn and attaches it as the canvas
+  void beginSlot(uint32_t i) {
+    slot = i;
+    InkShmSlot& next = header->slots[slot];
+    __atomic_store_n(&next.seq, next.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint8_t* pixels = (uint8_t*) header + header->data_offset +
+      header->slot_size * slot;
+    BLImage image;
+    image.createFromData(width, height, BL_FORMAT_PRGB32, pixels,
+                         header->stride);
+    attachCanvas(image);
+  }
+};
+
+// [[export]]
+SEXP ink_shm_c(SEXP name, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP options, SEXP slots) {
+  int bgCol = RGBpar(bg, 0);
+  InkOptions opts = read_options(options);
+  // The canvases live in the shared segment, which always holds PRGB32
+  opts.mmap = true;
+  opts.band = 0;
+  opts.opaque = 0;
+  InkDeviceShm* device = new InkDeviceShm(
+    CHAR(STRING_ELT(name, 0)),
+    INTEGER(width)[0],
+    INTEGER(height)[0],
+    REAL(pointsize)[0],
+    bgCol,
+    REAL(res)[0],
+    REAL(scaling)[0],
+    opts
+  );
+  if (!device->open(INTEGER(slots)[0])) {
+    delete device;
+    Rf_error("ink could not create the shared memory segment '%s'",
+             CHAR(STRING_ELT(name, 0)));
+  }
+  makeInkDevice<InkDeviceShm>(device, "ink_shm");
+
+  return R_NilValue;
+}
+
+/* Copies the newest complete page of a segment into a native raster. Returns
+ * NULL if no page has been completed yet
+ */
+// [[export]]
+SEXP ink_shm_read_c(SEXP name) {
+#if defined _WIN32
+  Rf_error("Shared memory devices are not supported on Windows");
+  return R_NilValue;
+#else
+  std::string path = shm_path(CHAR(STRING_ELT(name, 0)));
+  int fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    Rf_error("Could not open the shared memory segment '%s'", path.c_str());
+  }
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(InkShmHeader)) {
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    Rf_error("Could not map the shared memory segment '%s'", path.c_str());
+  }
+  const InkShmHeader* header = (const InkShmHeader*) addr;
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != INK_SHM_MAGIC ||
+      header->version != INK_SHM_VERSION ||
+      header->data_offset + header->slot_size * header->n_slots >
+        (uint64_t) st.st_size) {
+    munmap(addr, st.st_size);
+    Rf_error("'%s' is not an ink shared memory segment", path.c_str());
+  }
+
+  int w = header->width;
+  int h = header->height;
+  SEXP raster = R_NilValue;
+  if (__atomic_load_n(&header->frame, __ATOMIC_ACQUIRE) > 0) {
+    raster = PROTECT(Rf_allocVector(INTSXP, (R_xlen_t) w * h));
+    uint32_t* dest = (uint32_t*) INTEGER(raster);
+    bool consistent = false;
+    // The device may reuse the slot while it is copied, in which case the
+    // newest page is tried again
+    for (int attempt = 0; attempt < 1000 && !consistent; ++attempt) {
+      uint32_t slot;
+      uint64_t seq;
+      const uint8_t* pixels = ink_shm_begin_read(header, &slot, &seq);
+      if (pixels == NULL) continue;
+      for (int y = 0; y < h; ++y) {
+        unpremultiply_native(dest + (size_t) y * w,
+                             (const uint32_t*) (pixels + header->stride * y),
+                             w);
+      }
+      consistent = ink_shm_end_read(header, slot, seq);
+    }
+    if (!consistent) {
+      munmap(addr, st.st_size);
+      Rf_error("Could not read a complete page from '%s'", path.c_str());
+    }
+    SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(dims)[0] = h;
+    INTEGER(dims)[1] = w;
+    Rf_setAttrib(raster, R_DimSymbol, dims);
+    UNPROTECT(2);
+  }
+  munmap(addr, st.st_size);
+  return raster;
+#endif
+}
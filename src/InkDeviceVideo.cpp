@@ -0,0 +1,60 @@
+#include "ink.h"
+#include "InkDevice.h"
+#include "VideoWriter.h"
+#include "init_device.h"
+
+class InkDeviceVideo : public InkDevice {
+  VideoWriter writer;
+
+public:
+  InkDeviceVideo(const char* fp, int w, int h, double ps, int bg, double res,
+                 double scaling, const InkOptions& options, int format,
+                 double fps) :
+  InkDevice(fp, w, h, ps, bg, res, scaling, options),
+  writer(format, fps)
+  {
+
+  }
+  bool open(SEXP target) {
+    if (Rf_isInteger(target)) {
+      return writer.open(INTEGER(target)[0]);
+    }
+    return writer.open(CHAR(STRING_ELT(target, 0)));
+  }
+  // Lifecycle
+  void close() {
+    InkDevice::close();
+    if (!writer.close()) {
+      Rf_warning("ink could not close the video stream");
+    }
+  }
+  // Behaviour
+  bool writePage(const BLImage& image, int page) {
+    return writer.write(image);
+  };
+};
+
+// [[export]]
+SEXP ink_video_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+                 SEXP res, SEXP scaling, SEXP options, SEXP format, SEXP fps) {
+  int bgCol = RGBpar(bg, 0);
+  InkDeviceVideo* device = new InkDeviceVideo(
+    Rf_isInteger(file) ? "" : CHAR(STRING_ELT(file, 0)),
+    INTEGER(width)[0],
+    INTEGER(height)[0],
+    REAL(pointsize)[0],
+    bgCol,
+    REAL(res)[0],
+    REAL(scaling)[0],
+    read_options(options),
+    INTEGER(format)[0],
+    REAL(fps)[0]
+  );
+  if (!device->open(file)) {
+    delete device;
+    Rf_error("ink could not open the video stream for writing");
+  }
+  makeInkDevice<InkDeviceVideo>(device, "ink_video");
+
+  return R_NilValue;
+}
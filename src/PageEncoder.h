@@ -0,0 +1,129 @@
+#pragma once
+
+#include "ink.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Background encoder for finished pages.
+ *
+ * Pages are handed over as BLImages together with their page number and
+ * written on a separate thread, while the device continues drawing on a
+ * recycled canvas. The number of pages waiting to be written is bounded so
+ * that fast plotting code cannot pile up an unlimited number of canvases in
+ * memory. The write function is called from the encoder thread and must thus
+ * not touch the R API.
+ */
+class PageEncoder {
+  struct Job {
+    BLImage image;
+    int page;
+  };
+  typedef std::function<bool(const BLImage&, int)> WriteFunc;
+
+  WriteFunc write;
+  size_t limit;
+  int width;
+  int height;
+  uint32_t format;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable has_work;
+  std::condition_variable has_space;
+  std::deque<Job> queue;
+  std::vector<BLImage> spare;
+  bool busy = false;
+  bool stopping = false;
+  int failures = 0;
+
+public:
+  PageEncoder(WriteFunc write, size_t limit, int w, int h,
+              uint32_t format = BL_FORMAT_PRGB32) :
+    write(write),
+    limit(limit < 1 ? 1 : limit),
+    width(w),
+    height(h),
+    format(format)
+  {
+    worker = std::thread(&PageEncoder::run, this);
+  }
+  ~PageEncoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    has_work.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  // Queue a finished page for writing. Blocks while the queue is full
+  void push(BLImage& image, int page) {
+    std::unique_lock<std::mutex> lock(mutex);
+    has_space.wait(lock, [this] { return queue.size() < limit; });
+    Job job;
+    job.image = std::move(image);
+    job.page = page;
+    queue.push_back(std::move(job));
+    lock.unlock();
+    has_work.notify_one();
+  }
+
+  // Get a canvas to draw the next page on. Previously written canvases are
+  // reused so that at most limit + 2 canvases are ever alive
+  BLImage acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!spare.empty()) {
+        BLImage image = std::move(spare.back());
+        spare.pop_back();
+        return image;
+      }
+    }
+    return BLImage(width, height, format);
+  }
+
+  // Wait for all queued pages to be written
+  void drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    has_space.wait(lock, [this] { return queue.empty() && !busy; });
+  }
+
+  // Number of failed writes since last call
+  int take_failures() {
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = failures;
+    failures = 0;
+    return n;
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      has_work.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      Job job = std::move(queue.front());
+      queue.pop_front();
+      busy = true;
+      lock.unlock();
+      has_space.notify_all();
+
+      bool success = write(job.image, job.page);
+
+      lock.lock();
+      busy = false;
+      if (!success) failures++;
+      spare.push_back(std::move(job.image));
+      has_space.notify_all();
+    }
+  }
+};
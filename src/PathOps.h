@@ -0,0 +1,179 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelOps.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/* Geometry kernels used when building paths.
+ *
+ * R hands over coordinates as separate x and y arrays while Blend2D stores
+ * path vertices as interleaved points. append_polyline() reserves room for
+ * all vertices and commands in a single operation and fills them directly,
+ * interleaving the coordinates with SSE2 where available.
+ *
+ * Decimator reduces the number of vertices in very long polylines to what can
+ * actually be resolved at device resolution. Series that are monotone in x
+ * (the typical time series) are reduced per pixel column, keeping the first,
+ * last, minimum, and maximum point of each column (the M4 aggregation), so
+ * the vertical extent of the line within every column is kept. Other
+ * polylines are simplified with the Douglas-Peucker algorithm, which keeps
+ * the simplified line within TOLERANCE pixels of the original. Neither is
+ * exact: anti-aliased coverage and the joins between segments change
+ * slightly, which is why decimation is opt-in and only applied to solid
+ * strokes that are not filled.
+ */
+
+// Interleaves n coordinates from x and y into dest (x0, y0, x1, y1, ...)
+inline void interleave_points(double* dest, const double* x, const double* y,
+                              size_t n) {
+  size_t i = 0;
+#ifdef INK_SSE2
+  for (; i + 2 <= n; i += 2) {
+    __m128d vx = _mm_loadu_pd(x + i);
+    __m128d vy = _mm_loadu_pd(y + i);
+    _mm_storeu_pd(dest + 2 * i, _mm_unpacklo_pd(vx, vy));
+    _mm_storeu_pd(dest + 2 * i + 2, _mm_unpackhi_pd(vx, vy));
+  }
+#endif
+  for (; i < n; ++i) {
+    dest[2 * i] = x[i];
+    dest[2 * i + 1] = y[i];
+  }
+}
+
+/* Appends the n vertices in (x, y) to path as a new figure, closing it if
+ * requested
+ */
+inline BLResult append_polyline(BLPath& path, size_t n, const double* x,
+                                const double* y, bool close = false) {
+  if (n == 0) return BL_SUCCESS;
+  uint8_t* cmd;
+  BLPoint* vtx;
+  BLResult err = path.modifyOp(BL_MODIFY_OP_APPEND_GROW, n, &cmd, &vtx);
+  if (err != BL_SUCCESS) return err;
+  cmd[0] = BL_PATH_CMD_MOVE;
+  memset(cmd + 1, BL_PATH_CMD_ON, n - 1);
+  interleave_points((double*) vtx, x, y, n);
+  return close ? path.close() : BL_SUCCESS;
+}
+
+class Decimator {
+  static const int MIN_POINTS = 256;
+
+  std::vector<uint8_t> keep;
+  std::vector< std::pair<int, int> > stack;
+
+public:
+  // Maximum distance in pixels between the original and simplified line
+  static constexpr double TOLERANCE = 0.25;
+
+  std::vector<double> x;
+  std::vector<double> y;
+
+  /* Decimates the n points in (px, py) into x and y. Returns the number of
+   * points kept, or 0 if the polyline is too short to be worth decimating in
+   * which case x and y are left untouched
+   */
+  int run(int n, const double* px, const double* py) {
+    if (n < MIN_POINTS) return 0;
+    x.resize(n);
+    y.resize(n);
+    if (monotone(n, px)) {
+      return m4(n, px, py);
+    }
+    return douglas_peucker(n, px, py);
+  }
+
+private:
+  static bool monotone(int n, const double* px) {
+    bool increasing = true;
+    bool decreasing = true;
+    for (int i = 1; i < n && (increasing || decreasing); ++i) {
+      increasing = increasing && px[i] >= px[i - 1];
+      decreasing = decreasing && px[i] <= px[i - 1];
+    }
+    return increasing || decreasing;
+  }
+
+  int m4(int n, const double* px, const double* py) {
+    int m = 0;
+    int i = 0;
+    while (i < n) {
+      double column = std::floor(px[i]);
+      int lo = i;
+      int hi = i;
+      int j = i + 1;
+      for (; j < n && std::floor(px[j]) == column; ++j) {
+        if (py[j] < py[lo]) lo = j;
+        if (py[j] > py[hi]) hi = j;
+      }
+      // Emit first, min, max, and last in their original order
+      int idx[4] = {i, std::min(lo, hi), std::max(lo, hi), j - 1};
+      for (int k = 0; k < 4; ++k) {
+        if (k > 0 && idx[k] == idx[k - 1]) continue;
+        x[m] = px[idx[k]];
+        y[m] = py[idx[k]];
+        m++;
+      }
+      i = j;
+    }
+    return m;
+  }
+
+  int douglas_peucker(int n, const double* px, const double* py) {
+    const double tol2 = TOLERANCE * TOLERANCE;
+    keep.assign(n, 0);
+    keep[0] = 1;
+    keep[n - 1] = 1;
+    stack.clear();
+    stack.push_back(std::make_pair(0, n - 1));
+    while (!stack.empty()) {
+      int first = stack.back().first;
+      int last = stack.back().second;
+      stack.pop_back();
+      if (last - first < 2) continue;
+
+      double ax = px[first];
+      double ay = py[first];
+      double dx = px[last] - ax;
+      double dy = py[last] - ay;
+      double len2 = dx * dx + dy * dy;
+      double max_dist = -1.0;
+      int index = first;
+      for (int i = first + 1; i < last; ++i) {
+        // Squared distance from point i to the segment first-last
+        double vx = px[i] - ax;
+        double vy = py[i] - ay;
+        double t = len2 > 0.0 ? (vx * dx + vy * dy) / len2 : 0.0;
+        t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+        double ex = vx - t * dx;
+        double ey = vy - t * dy;
+        double dist = ex * ex + ey * ey;
+        if (dist > max_dist) {
+          max_dist = dist;
+          index = i;
+        }
+      }
+      if (max_dist > tol2) {
+        keep[index] = 1;
+        stack.push_back(std::make_pair(first, index));
+        stack.push_back(std::make_pair(index, last));
+      }
+    }
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+      if (keep[i]) {
+        x[m] = px[i];
+        y[m] = py[i];
+        m++;
+      }
+    }
+    return m;
+  }
+};
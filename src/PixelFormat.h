@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelOps.h"
+
+#include <cstring>
+
+/* Compile time specialisation on the pixel format of the canvas.
+ *
+ * Canvases are PRGB32, or XRGB32 for opaque devices, where Blend2D composites
+ * without an alpha channel. Code reading pixels off the canvas (capturing the
+ * page and writing it to files) is templated on the format, and dispatches on
+ * the format of the image once per page or band, so the per-pixel loops are
+ * compiled for each format without any branching. Files written from XRGB32
+ * canvases leave out the alpha channel where the file format allows it.
+ */
+template<uint32_t Format> struct PixelFormat;
+
+template<> struct PixelFormat<BL_FORMAT_PRGB32> {
+  // Bytes per pixel in files
+  static const int file_bytes = 4;
+
+  // Converts to R's native layout (RGBA bytes)
+  static void to_native(uint32_t* dest, const uint32_t* src, size_t n) {
+    unpremultiply_native(dest, src, n);
+  }
+  // Converts in place to 0xAARRGGBB words (BGRA bytes)
+  static void to_argb(uint32_t* pixels, size_t n) {
+    unpremultiply_argb(pixels, n);
+  }
+  // Converts to file_bytes pixels in RGB(A) byte order. dest must be aligned
+  // for uint32_t
+  static void to_rgb(uint8_t* dest, const uint32_t* src, size_t n) {
+    unpremultiply_native((uint32_t*) dest, src, n);
+  }
+  // Converts to file_bytes pixels in BGR(A) byte order. dest must be aligned
+  // for uint32_t
+  static void to_bgr(uint8_t* dest, const uint32_t* src, size_t n) {
+    memcpy(dest, src, 4 * n);
+    unpremultiply_argb((uint32_t*) dest, n);
+  }
+};
+
+template<> struct PixelFormat<BL_FORMAT_XRGB32> {
+  static const int file_bytes = 3;
+
+  static void to_native(uint32_t* dest, const uint32_t* src, size_t n) {
+    xrgb_to_native(dest, src, n);
+  }
+  static void to_argb(uint32_t* pixels, size_t n) {
+    xrgb_to_argb(pixels, n);
+  }
+  static void to_rgb(uint8_t* dest, const uint32_t* src, size_t n) {
+    xrgb_to_rgb24(dest, src, n);
+  }
+  static void to_bgr(uint8_t* dest, const uint32_t* src, size_t n) {
+    xrgb_to_bgr24(dest, src, n);
+  }
+};
+
+// Bytes per pixel in files written from a canvas of the given format
+inline int file_bytes(uint32_t format) {
+  return format == BL_FORMAT_XRGB32 ?
+    PixelFormat<BL_FORMAT_XRGB32>::file_bytes :
+    PixelFormat<BL_FORMAT_PRGB32>::file_bytes;
+}
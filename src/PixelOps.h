@@ -0,0 +1,485 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define INK_SSE2
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define INK_AVX2 __attribute__((target("avx2")))
+#endif
+
+/* Pixel conversion kernels.
+ *
+ * Blend2D stores pixels as premultiplied 0xAARRGGBB words (PRGB32), while R
+ * and most file formats expect non-premultiplied colours. R's native layout
+ * (R | G << 8 | B << 16 | A << 24) is RGBA in memory on little-endian systems,
+ * which is also the byte order used by PNG, so a single kernel serves both.
+ *
+ * The kernels are vectorised using SSE2 where available at compile time and
+ * AVX2 if the CPU supports it at runtime. The scalar versions handle the tails
+ * and other architectures. All versions produce identical output.
+ */
+
+// Un-premultiply a single channel. Uses float math so that vectorised
+// versions can produce identical results
+inline uint32_t unpremultiply_channel(uint32_t c, float scale) {
+  uint32_t v = (uint32_t) ((float) c * scale + 0.5f);
+  return v > 255 ? 255 : v;
+}
+
+inline void unpremultiply_native_scalar(uint32_t* dest, const uint32_t* src,
+                                        size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    uint32_t a = p >> 24;
+    if (a == 255) {
+      dest[i] = (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+      continue;
+    }
+    if (a == 0) {
+      dest[i] = 0;
+      continue;
+    }
+    float scale = 255.0f / (float) a;
+    uint32_t r = unpremultiply_channel((p >> 16) & 0xFF, scale);
+    uint32_t g = unpremultiply_channel((p >> 8) & 0xFF, scale);
+    uint32_t b = unpremultiply_channel(p & 0xFF, scale);
+    dest[i] = r | (g << 8) | (b << 16) | (a << 24);
+  }
+}
+
+#ifdef INK_SSE2
+// Un-premultiplies 4 pixels. Each channel is converted to float, scaled with
+// 255 / alpha, and clamped. Transparent pixels give NaN which converts to
+// 0x80000000 and is thus masked to 0 by the clamping.
+inline __m128i unpremultiply_sse2_channel(__m128i c, __m128 scale) {
+  const __m128i max = _mm_set1_epi32(255);
+  __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(c), scale),
+                        _mm_set1_ps(0.5f));
+  __m128i v = _mm_cvttps_epi32(f);
+  v = _mm_or_si128(v, _mm_cmpgt_epi32(v, max));
+  return _mm_and_si128(v, max);
+}
+inline void unpremultiply_native_sse2(uint32_t* dest, const uint32_t* src,
+                                      size_t n) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  const __m128i mask_ag = _mm_set1_epi32(0xFF00FF00);
+  const __m128 full = _mm_set1_ps(255.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i a = _mm_srli_epi32(p, 24);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+    __m128i b = _mm_and_si128(p, mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, mask)) == 0xFFFF) {
+      // Opaque: only swap red and blue
+      __m128i out = _mm_or_si128(_mm_and_si128(p, mask_ag),
+                                 _mm_or_si128(r, _mm_slli_epi32(b, 16)));
+      _mm_storeu_si128((__m128i*) (dest + i), out);
+      continue;
+    }
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+    __m128 scale = _mm_div_ps(full, _mm_cvtepi32_ps(a));
+    r = unpremultiply_sse2_channel(r, scale);
+    g = unpremultiply_sse2_channel(g, scale);
+    b = unpremultiply_sse2_channel(b, scale);
+    __m128i out = _mm_or_si128(
+      _mm_or_si128(r, _mm_slli_epi32(g, 8)),
+      _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(a, 24))
+    );
+    _mm_storeu_si128((__m128i*) (dest + i), out);
+  }
+  unpremultiply_native_scalar(dest + i, src + i, n - i);
+}
+#endif
+
+#ifdef INK_AVX2
+INK_AVX2 inline __m256i unpremultiply_avx2_channel(__m256i c, __m256 scale) {
+  const __m256i max = _mm256_set1_epi32(255);
+  __m256 f = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(c), scale),
+                           _mm256_set1_ps(0.5f));
+  __m256i v = _mm256_cvttps_epi32(f);
+  v = _mm256_or_si256(v, _mm256_cmpgt_epi32(v, max));
+  return _mm256_and_si256(v, max);
+}
+INK_AVX2 inline void unpremultiply_native_avx2(uint32_t* dest,
+                                               const uint32_t* src, size_t n) {
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  const __m256i mask_ag = _mm256_set1_epi32(0xFF00FF00);
+  const __m256 full = _mm256_set1_ps(255.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i*) (src + i));
+    __m256i a = _mm256_srli_epi32(p, 24);
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+    __m256i b = _mm256_and_si256(p, mask);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, mask)) == -1) {
+      __m256i out = _mm256_or_si256(
+        _mm256_and_si256(p, mask_ag),
+        _mm256_or_si256(r, _mm256_slli_epi32(b, 16))
+      );
+      _mm256_storeu_si256((__m256i*) (dest + i), out);
+      continue;
+    }
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    __m256 scale = _mm256_div_ps(full, _mm256_cvtepi32_ps(a));
+    r = unpremultiply_avx2_channel(r, scale);
+    g = unpremultiply_avx2_channel(g, scale);
+    b = unpremultiply_avx2_channel(b, scale);
+    __m256i out = _mm256_or_si256(
+      _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+      _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_slli_epi32(a, 24))
+    );
+    _mm256_storeu_si256((__m256i*) (dest + i), out);
+  }
+  unpremultiply_native_scalar(dest + i, src + i, n - i);
+}
+
+inline bool cpu_has_avx2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+#endif
+
+/* Converts n PRGB32 pixels in src to non-premultiplied pixels in R's native
+ * layout in dest. dest and src may be the same buffer.
+ */
+inline void unpremultiply_native(uint32_t* dest, const uint32_t* src,
+                                 size_t n) {
+#ifdef INK_AVX2
+  if (cpu_has_avx2()) {
+    unpremultiply_native_avx2(dest, src, n);
+    return;
+  }
+#endif
+#ifdef INK_SSE2
+  unpremultiply_native_sse2(dest, src, n);
+#else
+  unpremultiply_native_scalar(dest, src, n);
+#endif
+}
+
+inline void unpremultiply_argb_scalar(uint32_t* pixels, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = pixels[i];
+    uint32_t a = p >> 24;
+    if (a == 255) continue;
+    if (a == 0) {
+      pixels[i] = 0;
+      continue;
+    }
+    float scale = 255.0f / (float) a;
+    uint32_t r = unpremultiply_channel((p >> 16) & 0xFF, scale);
+    uint32_t g = unpremultiply_channel((p >> 8) & 0xFF, scale);
+    uint32_t b = unpremultiply_channel(p & 0xFF, scale);
+    pixels[i] = b | (g << 8) | (r << 16) | (a << 24);
+  }
+}
+
+/* Un-premultiplies n PRGB32 pixels in place, keeping the 0xAARRGGBB layout
+ * used by 32-bit BMP files. Opaque pixels are left untouched, and with SSE2
+ * runs of opaque pixels are skipped 4 at a time, so a fully opaque page is
+ * only ever read.
+ */
+inline void unpremultiply_argb(uint32_t* pixels, size_t n) {
+  size_t i = 0;
+#ifdef INK_SSE2
+  const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i*) (pixels + i)),
+                              alpha);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(p, alpha)) != 0xFFFF) {
+      unpremultiply_argb_scalar(pixels + i, 4);
+    }
+  }
+#endif
+  unpremultiply_argb_scalar(pixels + i, n - i);
+}
+
+/* Converts n non-premultiplied pixels in R's native layout in src to PRGB32
+ * pixels in dest. Channels are premultiplied using the usual rounded division
+ * by 255 in 16-bit math.
+ */
+inline void premultiply_native_scalar(uint32_t* dest, const uint32_t* src,
+                                      size_t n) {
+  uint16_t r, g, b, a;
+  for (size_t i = 0; i < n; i++){
+    a = src[i] >> 24;
+    if (a == 0) {
+      dest[i] = 0;
+      continue;
+    }
+    r = (src[i] & 0xFF) * a;
+    r = (r + 1 + ((r + 1) >> 8)) >> 8;
+    g = ((src[i] >> 8) & 0xFF) * a;
+    g = (g + 1 + ((g + 1) >> 8)) >> 8;
+    b = ((src[i] >> 16) & 0xFF) * a;
+    b = (b + 1 + ((b + 1) >> 8)) >> 8;
+    dest[i] = ((b)|((g)<<8)|((r)<<16)|((a)<<24));
+  }
+}
+
+#ifdef INK_SSE2
+// Premultiplies 2 pixels unpacked to 16-bit channels and swaps red and blue
+inline __m128i premultiply_sse2_half(__m128i c) {
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xFF), 0xFF);
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), one);
+  t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+  t = _mm_or_si128(_mm_andnot_si128(alpha_mask, t),
+                   _mm_and_si128(alpha_mask, a));
+  // RGBA -> BGRA
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(t, 0xC6), 0xC6);
+}
+inline void premultiply_native_sse2(uint32_t* dest, const uint32_t* src,
+                                    size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i lo = premultiply_sse2_half(_mm_unpacklo_epi8(p, zero));
+    __m128i hi = premultiply_sse2_half(_mm_unpackhi_epi8(p, zero));
+    _mm_storeu_si128((__m128i*) (dest + i), _mm_packus_epi16(lo, hi));
+  }
+  premultiply_native_scalar(dest + i, src + i, n - i);
+}
+#endif
+
+#ifdef INK_AVX2
+INK_AVX2 inline __m256i premultiply_avx2_half(__m256i c) {
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i alpha_mask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+                                              -1, 0, 0, 0, -1, 0, 0, 0);
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, 0xFF), 0xFF);
+  __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(c, a), one);
+  t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+  t = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, t),
+                      _mm256_and_si256(alpha_mask, a));
+  return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(t, 0xC6), 0xC6);
+}
+INK_AVX2 inline void premultiply_native_avx2(uint32_t* dest,
+                                             const uint32_t* src, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i*) (src + i));
+    __m256i lo = premultiply_avx2_half(_mm256_unpacklo_epi8(p, zero));
+    __m256i hi = premultiply_avx2_half(_mm256_unpackhi_epi8(p, zero));
+    _mm256_storeu_si256((__m256i*) (dest + i), _mm256_packus_epi16(lo, hi));
+  }
+  premultiply_native_scalar(dest + i, src + i, n - i);
+}
+#endif
+
+/* Converts n pixels in R's native layout in src to PRGB32 pixels in dest.
+ * dest and src may be the same buffer.
+ */
+inline void premultiply_native(uint32_t* dest, const uint32_t* src,
+                               size_t n) {
+#ifdef INK_AVX2
+  if (cpu_has_avx2()) {
+    premultiply_native_avx2(dest, src, n);
+    return;
+  }
+#endif
+#ifdef INK_SSE2
+  premultiply_native_sse2(dest, src, n);
+#else
+  premultiply_native_scalar(dest, src, n);
+#endif
+}
+
+/* Converts n XRGB32 pixels in src to R's native layout in dest. The unused
+ * byte is not relied upon, all pixels come out opaque. dest and src may be
+ * the same buffer. These opaque kernels are simple enough for the compiler to
+ * vectorise.
+ */
+inline void xrgb_to_native(uint32_t* dest, const uint32_t* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    dest[i] = 0xFF000000 | (p & 0x0000FF00) | ((p >> 16) & 0xFF) |
+      ((p & 0xFF) << 16);
+  }
+}
+
+// Makes n XRGB32 pixels opaque 0xAARRGGBB pixels in place
+inline void xrgb_to_argb(uint32_t* pixels, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    pixels[i] |= 0xFF000000;
+  }
+}
+
+// Packs n XRGB32 pixels in src into 24-bit pixels in dest in RGB byte order
+// (as used by PNG)
+inline void xrgb_to_rgb24(uint8_t* dest, const uint32_t* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    dest[3 * i] = (p >> 16) & 0xFF;
+    dest[3 * i + 1] = (p >> 8) & 0xFF;
+    dest[3 * i + 2] = p & 0xFF;
+  }
+}
+
+// Packs n XRGB32 pixels in src into 24-bit pixels in dest in BGR byte order
+// (as used by BMP)
+inline void xrgb_to_bgr24(uint8_t* dest, const uint32_t* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    dest[3 * i] = p & 0xFF;
+    dest[3 * i + 1] = (p >> 8) & 0xFF;
+    dest[3 * i + 2] = (p >> 16) & 0xFF;
+  }
+}
+
+/* Converts PRGB32 pixels to 8-bit YUV using the BT.601 limited range integer
+ * approximations, as expected by y4m consumers. Pixels are converted as
+ * stored, i.e. translucent pixels end up composited over black. Chroma is
+ * computed from the rounded average of each 2x2 block (4:2:0 subsampling) with
+ * the last row and column repeated for odd sizes. The SSE2 versions use the
+ * same integer math and thus produce identical output.
+ */
+inline uint8_t rgb_to_y(int r, int g, int b) {
+  return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+inline uint8_t rgb_to_u(int r, int g, int b) {
+  return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+inline uint8_t rgb_to_v(int r, int g, int b) {
+  return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+inline void prgb_to_luma_scalar(uint8_t* dest, const uint32_t* src,
+                                size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    dest[i] = rgb_to_y((p >> 16) & 0xFF, (p >> 8) & 0xFF, p & 0xFF);
+  }
+}
+
+// Converts the 2x2 blocks of row0 and row1 starting from pixel begin (which
+// must be even)
+inline void prgb_to_chroma_scalar(uint8_t* u, uint8_t* v,
+                                  const uint32_t* row0, const uint32_t* row1,
+                                  size_t begin, size_t n) {
+  for (size_t x = begin; x < n; x += 2) {
+    size_t x1 = x + 1 < n ? x + 1 : x;
+    uint32_t p[4] = {row0[x], row0[x1], row1[x], row1[x1]};
+    int r = 0, g = 0, b = 0;
+    for (int k = 0; k < 4; ++k) {
+      r += (p[k] >> 16) & 0xFF;
+      g += (p[k] >> 8) & 0xFF;
+      b += p[k] & 0xFF;
+    }
+    r = (r + 2) >> 2;
+    g = (g + 2) >> 2;
+    b = (b + 2) >> 2;
+    u[x / 2] = rgb_to_u(r, g, b);
+    v[x / 2] = rgb_to_v(r, g, b);
+  }
+}
+
+#ifdef INK_SSE2
+// Sums the two partial dot products of each pixel left by _mm_madd_epi16 and
+// packs the results of two such vectors into the lower 64 bits
+inline __m128i yuv_sse2_gather(__m128i a) {
+  a = _mm_add_epi32(a, _mm_srli_epi64(a, 32));
+  return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 2, 0));
+}
+inline void prgb_to_luma_sse2(uint8_t* dest, const uint32_t* src, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  // Weights of the B, G, R, and A bytes of two pixels
+  const __m128i coef = _mm_set_epi16(0, 66, 129, 25, 0, 66, 129, 25);
+  const __m128i round = _mm_set1_epi32(128);
+  const __m128i offset = _mm_set1_epi32(16);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i lo = yuv_sse2_gather(_mm_madd_epi16(_mm_unpacklo_epi8(p, zero),
+                                                coef));
+    __m128i hi = yuv_sse2_gather(_mm_madd_epi16(_mm_unpackhi_epi8(p, zero),
+                                                coef));
+    __m128i y = _mm_unpacklo_epi64(lo, hi);
+    y = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(y, round), 8), offset);
+    y = _mm_packus_epi16(_mm_packs_epi32(y, y), zero);
+    uint32_t bytes = _mm_cvtsi128_si32(y);
+    memcpy(dest + i, &bytes, 4);
+  }
+  prgb_to_luma_scalar(dest + i, src + i, n - i);
+}
+inline void prgb_to_chroma_sse2(uint8_t* u, uint8_t* v, const uint32_t* row0,
+                                const uint32_t* row1, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i coef_u = _mm_set_epi16(0, -38, -74, 112, 0, -38, -74, 112);
+  const __m128i coef_v = _mm_set_epi16(0, 112, -94, -18, 0, 112, -94, -18);
+  const __m128i round = _mm_set1_epi32(128);
+  const __m128i offset = _mm_set1_epi32(128);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p0 = _mm_loadu_si128((const __m128i*) (row0 + i));
+    __m128i p1 = _mm_loadu_si128((const __m128i*) (row1 + i));
+    // Sum each 2x2 block in 16 bit channels
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(p0, zero),
+                               _mm_unpacklo_epi8(p1, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(p0, zero),
+                               _mm_unpackhi_epi8(p1, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    __m128i avg = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                                               two), 2);
+    __m128i uv = _mm_unpacklo_epi64(
+      yuv_sse2_gather(_mm_madd_epi16(avg, coef_u)),
+      yuv_sse2_gather(_mm_madd_epi16(avg, coef_v))
+    );
+    uv = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(uv, round), 8), offset);
+    uv = _mm_packus_epi16(_mm_packs_epi32(uv, uv), zero);
+    uint32_t bytes = _mm_cvtsi128_si32(uv);
+    u[i / 2] = bytes & 0xFF;
+    u[i / 2 + 1] = (bytes >> 8) & 0xFF;
+    v[i / 2] = (bytes >> 16) & 0xFF;
+    v[i / 2 + 1] = (bytes >> 24) & 0xFF;
+  }
+  prgb_to_chroma_scalar(u, v, row0, row1, i, n);
+}
+#endif
+
+inline void prgb_to_luma(uint8_t* dest, const uint32_t* src, size_t n) {
+#ifdef INK_SSE2
+  prgb_to_luma_sse2(dest, src, n);
+#else
+  prgb_to_luma_scalar(dest, src, n);
+#endif
+}
+inline void prgb_to_chroma(uint8_t* u, uint8_t* v, const uint32_t* row0,
+                           const uint32_t* row1, size_t n) {
+#ifdef INK_SSE2
+  prgb_to_chroma_sse2(u, v, row0, row1, n);
+#else
+  prgb_to_chroma_scalar(u, v, row0, row1, 0, n);
+#endif
+}
+
+/* Converts a w x h PRGB32 image with the given stride into the planes of a
+ * YUV 4:2:0 image (with chroma planes of (w + 1) / 2 x (h + 1) / 2)
+ */
+inline void prgb_to_yuv420(uint8_t* y, uint8_t* u, uint8_t* v,
+                           const uint8_t* pixels, intptr_t stride, int w,
+                           int h) {
+  size_t chroma_w = (w + 1) / 2;
+  for (int row = 0; row < h; ++row) {
+    const uint32_t* src = (const uint32_t*) (pixels + stride * row);
+    prgb_to_luma(y + (size_t) w * row, src, w);
+    if (row % 2 == 0) {
+      const uint32_t* next = row + 1 < h ?
+        (const uint32_t*) (pixels + stride * (row + 1)) : src;
+      prgb_to_chroma(u + chroma_w * (row / 2), v + chroma_w * (row / 2), src,
+                     next, w);
+    }
+  }
+}
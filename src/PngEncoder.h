@@ -0,0 +1,457 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelFormat.h"
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+enum PngFilter {
+  PNG_FILTER_NONE = 0,
+  PNG_FILTER_SUB = 1,
+  PNG_FILTER_UP = 2,
+  PNG_FILTER_AVERAGE = 3,
+  PNG_FILTER_PAETH = 4,
+  PNG_FILTER_ADAPTIVE = 5
+};
+
+/* Encoder for 8-bit RGBA PNG files, or RGB files for opaque (XRGB32)
+ * canvases.
+ *
+ * Blend2D's own PNG codec offers no control over compression, so ink encodes
+ * PNG files itself using zlib. The compression level and scanline filter can
+ * be set freely. If more than one thread is requested the scanlines are
+ * filtered in parallel stripes and the deflate stream is compressed in
+ * independent blocks the same way pigz does it: each block is primed with the
+ * last 32Kb of the preceding block as dictionary and ended with a sync flush,
+ * so the blocks can be concatenated into a single valid stream.
+ *
+ * Pages can also be encoded a band of rows at a time with begin(),
+ * write_rows(), and end(). The filtered rows are then deflated serially into
+ * a single stream as they arrive and written out in IDAT chunks, so only the
+ * current band is ever held in memory.
+ *
+ * The encoder keeps its buffers between pages. It is not thread safe, but
+ * may be used from another thread than the one creating it.
+ */
+class PngEncoder {
+  static const size_t BLOCK_SIZE = 128 * 1024;
+  static const size_t WINDOW_SIZE = 32 * 1024;
+  static const size_t CHUNK_SIZE = 1024 * 1024;
+
+  int level;
+  int filter;
+  int threads;
+  uint32_t ppm;
+
+  std::vector<uint8_t> filtered;
+  std::vector<uint8_t> stream;
+  std::vector< std::vector<uint8_t> > blocks;
+  std::vector<uLong> block_adler;
+
+  // State of a page written in bands
+  FILE* file = NULL;
+  z_stream strm;
+  int width = 0;
+  int next_row = 0;
+  int height = 0;
+  uint32_t format = BL_FORMAT_PRGB32;
+  std::vector<uint32_t> last_row;
+
+public:
+  PngEncoder(int level, int filter, int threads, double res) :
+    level(level < 0 ? 0 : (level > 9 ? 9 : level)),
+    filter(filter),
+    threads(threads < 1 ? 1 : threads),
+    ppm((uint32_t) (res / 0.0254 + 0.5))
+  {
+
+  }
+  ~PngEncoder() {
+    if (file != NULL) end();
+  }
+
+  bool write(const BLImage& image, const char* path) {
+    BLImageData data;
+    if (image.getData(&data) != BL_SUCCESS) {
+      return false;
+    }
+    int w = data.size.w;
+    int h = data.size.h;
+    format = data.format;
+    size_t row_size = file_bytes(format) * (size_t) w + 1;
+    filtered.resize(row_size * h);
+
+    int n_stripes = threads > h ? h : threads;
+    parallel_for(n_stripes, [&](int i) {
+      int begin = (int) ((int64_t) h * i / n_stripes);
+      int end = (int) ((int64_t) h * (i + 1) / n_stripes);
+      filter_stripe(data, begin, end, NULL);
+    });
+
+    bool success = threads > 1 && filtered.size() > 2 * BLOCK_SIZE ?
+      deflate_parallel() : deflate_serial();
+    if (!success) {
+      return false;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+      return false;
+    }
+    success = write_header(f, w, h);
+
+    const size_t max_chunk = 1 << 30;
+    for (size_t pos = 0; success && pos < stream.size(); pos += max_chunk) {
+      size_t len = stream.size() - pos;
+      len = len > max_chunk ? max_chunk : len;
+      success = write_chunk(f, "IDAT", stream.data() + pos, len);
+    }
+    success = success && write_chunk(f, "IEND", NULL, 0);
+
+    return fclose(f) == 0 && success;
+  }
+
+  // Opens the file and writes the header for an image of w x h pixels drawn
+  // on a canvas of the given pixel format
+  bool begin(const char* path, int w, int h,
+             uint32_t canvas_format = BL_FORMAT_PRGB32) {
+    if (file != NULL) end();
+    strm = z_stream();
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15, 8, strategy()) != Z_OK) {
+      return false;
+    }
+    file = fopen(path, "wb");
+    if (file == NULL) {
+      deflateEnd(&strm);
+      return false;
+    }
+    width = w;
+    height = h;
+    next_row = 0;
+    format = canvas_format;
+    stream.resize(CHUNK_SIZE);
+    strm.next_out = stream.data();
+    strm.avail_out = stream.size();
+    return write_header(file, w, h);
+  }
+
+  // Filters and deflates the first rows of image as the next rows of the page
+  bool write_rows(const BLImage& image, int rows) {
+    if (file == NULL) return false;
+    BLImageData data;
+    if (image.getData(&data) != BL_SUCCESS || data.size.w != width ||
+        data.format != format) {
+      return false;
+    }
+    rows = rows > height - next_row ? height - next_row : rows;
+    if (rows <= 0) return true;
+    size_t row_size = file_bytes(format) * (size_t) width + 1;
+    filtered.resize(row_size * rows);
+
+    // The first row is filtered against the last row of the previous band
+    const uint32_t* above = next_row > 0 ? last_row.data() : NULL;
+    int n_stripes = threads > rows ? rows : threads;
+    parallel_for(n_stripes, [&](int i) {
+      int begin = (int) ((int64_t) rows * i / n_stripes);
+      int end = (int) ((int64_t) rows * (i + 1) / n_stripes);
+      filter_stripe(data, begin, end, above);
+    });
+    const uint32_t* last = pixel_row(data, rows - 1);
+    last_row.assign(last, last + width);
+    next_row += rows;
+
+    strm.next_in = filtered.data();
+    strm.avail_in = filtered.size();
+    return deflate_stream(Z_NO_FLUSH);
+  }
+
+  // Finishes the stream and closes the file. Returns false if not all rows
+  // were written
+  bool end() {
+    if (file == NULL) return false;
+    bool success = next_row == height && deflate_stream(Z_FINISH);
+    size_t len = stream.size() - strm.avail_out;
+    if (success && len > 0) {
+      success = write_chunk(file, "IDAT", stream.data(), len);
+    }
+    success = success && write_chunk(file, "IEND", NULL, 0);
+    deflateEnd(&strm);
+    success = fclose(file) == 0 && success;
+    file = NULL;
+    return success;
+  }
+
+private:
+  bool write_header(FILE* f, int w, int h) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    bool success = fwrite(signature, 1, 8, f) == 8;
+
+    uint8_t ihdr[13];
+    put_uint32(ihdr, w);
+    put_uint32(ihdr + 4, h);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = file_bytes(format) == 4 ? 6 : 2; // colour type: RGBA or RGB
+    ihdr[10] = 0; // compression
+    ihdr[11] = 0; // filter method
+    ihdr[12] = 0; // no interlace
+    success = success && write_chunk(f, "IHDR", ihdr, 13);
+
+    uint8_t phys[9];
+    put_uint32(phys, ppm);
+    put_uint32(phys + 4, ppm);
+    phys[8] = 1;  // unit is metre
+    return success && write_chunk(f, "pHYs", phys, 9);
+  }
+
+  // Deflates the pending input of a banded page, writing an IDAT chunk each
+  // time the output buffer fills up
+  bool deflate_stream(int flush) {
+    while (true) {
+      if (strm.avail_out == 0) {
+        if (!write_chunk(file, "IDAT", stream.data(), stream.size())) {
+          return false;
+        }
+        strm.next_out = stream.data();
+        strm.avail_out = stream.size();
+      }
+      int err = deflate(&strm, flush);
+      if (err == Z_STREAM_ERROR) return false;
+      if (flush == Z_FINISH) {
+        if (err == Z_STREAM_END) return true;
+      } else if (strm.avail_in == 0 && strm.avail_out > 0) {
+        return true;
+      }
+    }
+  }
+
+  template<typename F>
+  void parallel_for(int n, F fun) {
+    if (n <= 1 || threads <= 1) {
+      for (int i = 0; i < n; ++i) fun(i);
+      return;
+    }
+    std::atomic<int> next(0);
+    auto work = [&]() {
+      int i;
+      while ((i = next++) < n) fun(i);
+    };
+    int n_threads = threads > n ? n : threads;
+    std::vector<std::thread> pool;
+    for (int i = 1; i < n_threads; ++i) {
+      pool.push_back(std::thread(work));
+    }
+    work();
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool[i].join();
+    }
+  }
+
+  void filter_stripe(const BLImageData& data, int begin, int end,
+                     const uint32_t* above) {
+    if (data.format == BL_FORMAT_XRGB32) {
+      filter_stripe<BL_FORMAT_XRGB32>(data, begin, end, above);
+    } else {
+      filter_stripe<BL_FORMAT_PRGB32>(data, begin, end, above);
+    }
+  }
+
+  // Converts and filters the rows in [begin, end). If given, above is the
+  // (unconverted) row preceding the first row of data
+  template<uint32_t Format>
+  void filter_stripe(const BLImageData& data, int begin, int end,
+                     const uint32_t* above) {
+    typedef PixelFormat<Format> Pixels;
+    int w = data.size.w;
+    int bpp = Pixels::file_bytes;
+    size_t bytes = bpp * (size_t) w;
+    std::vector<uint32_t> rows(2 * (size_t) w, 0);
+    uint8_t* cur = (uint8_t*) rows.data();
+    uint8_t* prev = (uint8_t*) (rows.data() + w);
+    std::vector<uint8_t> trial(filter == PNG_FILTER_ADAPTIVE ? 5 * bytes : 0);
+
+    if (begin > 0) {
+      Pixels::to_rgb(prev, pixel_row(data, begin - 1), w);
+    } else if (above != NULL) {
+      Pixels::to_rgb(prev, above, w);
+    }
+    for (int y = begin; y < end; ++y) {
+      Pixels::to_rgb(cur, pixel_row(data, y), w);
+      uint8_t* out = filtered.data() + (bytes + 1) * y;
+      if (filter != PNG_FILTER_ADAPTIVE) {
+        out[0] = filter;
+        filter_row(filter, out + 1, cur, prev, bytes, bpp);
+      } else {
+        // Minimum sum of absolute differences heuristic (as used by libpng)
+        int best = 0;
+        uint64_t best_sum = UINT64_MAX;
+        for (int f = 0; f < 5; ++f) {
+          uint8_t* candidate = trial.data() + f * bytes;
+          filter_row(f, candidate, cur, prev, bytes, bpp);
+          uint64_t sum = 0;
+          for (size_t i = 0; i < bytes; ++i) {
+            int v = (int8_t) candidate[i];
+            sum += v < 0 ? -v : v;
+          }
+          if (sum < best_sum) {
+            best_sum = sum;
+            best = f;
+          }
+        }
+        out[0] = best;
+        memcpy(out + 1, trial.data() + best * bytes, bytes);
+      }
+      std::swap(cur, prev);
+    }
+  }
+
+  inline const uint32_t* pixel_row(const BLImageData& data, int y) {
+    const uint8_t* pixels = (const uint8_t*) data.pixelData;
+    return (const uint32_t*) (pixels + data.stride * y);
+  }
+
+  // Filters a row of n bytes with bpp bytes per pixel
+  void filter_row(int type, uint8_t* out, const uint8_t* cur,
+                  const uint8_t* prev, size_t n, size_t bpp) {
+    switch (type) {
+    case PNG_FILTER_NONE:
+      memcpy(out, cur, n);
+      break;
+    case PNG_FILTER_SUB:
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = cur[i] - (i < bpp ? 0 : cur[i - bpp]);
+      }
+      break;
+    case PNG_FILTER_UP:
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = cur[i] - prev[i];
+      }
+      break;
+    case PNG_FILTER_AVERAGE:
+      for (size_t i = 0; i < n; ++i) {
+        int left = i < bpp ? 0 : cur[i - bpp];
+        out[i] = cur[i] - ((left + prev[i]) >> 1);
+      }
+      break;
+    case PNG_FILTER_PAETH:
+      for (size_t i = 0; i < n; ++i) {
+        int a = i < bpp ? 0 : cur[i - bpp];
+        int b = prev[i];
+        int c = i < bpp ? 0 : prev[i - bpp];
+        int pa = abs(b - c);
+        int pb = abs(a - c);
+        int pc = abs(a + b - 2 * c);
+        int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+        out[i] = cur[i] - pred;
+      }
+      break;
+    }
+  }
+
+  int strategy() {
+    return filter == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  }
+
+  bool deflate_serial() {
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15, 8, strategy()) != Z_OK) {
+      return false;
+    }
+    stream.resize(deflateBound(&strm, filtered.size()));
+    strm.next_in = filtered.data();
+    strm.avail_in = filtered.size();
+    strm.next_out = stream.data();
+    strm.avail_out = stream.size();
+    int err = deflate(&strm, Z_FINISH);
+    stream.resize(strm.total_out);
+    deflateEnd(&strm);
+    return err == Z_STREAM_END;
+  }
+
+  bool deflate_parallel() {
+    size_t size = filtered.size();
+    int n_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocks.resize(n_blocks);
+    block_adler.resize(n_blocks);
+    std::atomic<bool> failed(false);
+
+    parallel_for(n_blocks, [&](int i) {
+      size_t start = i * BLOCK_SIZE;
+      size_t len = start + BLOCK_SIZE > size ? size - start : BLOCK_SIZE;
+      bool last = i == n_blocks - 1;
+      block_adler[i] = adler32(adler32(0L, Z_NULL, 0), filtered.data() + start,
+                               len);
+
+      z_stream strm = {};
+      if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy()) != Z_OK) {
+        failed = true;
+        return;
+      }
+      if (i > 0) {
+        size_t dict = start < WINDOW_SIZE ? start : WINDOW_SIZE;
+        deflateSetDictionary(&strm, filtered.data() + start - dict, dict);
+      }
+      std::vector<uint8_t>& out = blocks[i];
+      out.resize(deflateBound(&strm, len) + 16);
+      strm.next_in = filtered.data() + start;
+      strm.avail_in = len;
+      strm.next_out = out.data();
+      strm.avail_out = out.size();
+      int err = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+      if ((last && err != Z_STREAM_END) || (!last && err != Z_OK) ||
+          strm.avail_in != 0 || strm.avail_out == 0) {
+        failed = true;
+      }
+      out.resize(strm.total_out);
+      deflateEnd(&strm);
+    });
+    if (failed) {
+      return false;
+    }
+
+    // zlib header matching the compression level
+    static const uint8_t level_flag[10] = {
+      0x01, 0x01, 0x5E, 0x5E, 0x5E, 0x5E, 0x9C, 0xDA, 0xDA, 0xDA
+    };
+    stream.clear();
+    stream.push_back(0x78);
+    stream.push_back(level_flag[level]);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int i = 0; i < n_blocks; ++i) {
+      stream.insert(stream.end(), blocks[i].begin(), blocks[i].end());
+      size_t len = i == n_blocks - 1 ? size - i * BLOCK_SIZE : BLOCK_SIZE;
+      adler = adler32_combine(adler, block_adler[i], len);
+    }
+    uint8_t trailer[4];
+    put_uint32(trailer, adler);
+    stream.insert(stream.end(), trailer, trailer + 4);
+    return true;
+  }
+
+  static void put_uint32(uint8_t* buf, uint32_t value) {
+    buf[0] = (value >> 24) & 0xFF;
+    buf[1] = (value >> 16) & 0xFF;
+    buf[2] = (value >> 8) & 0xFF;
+    buf[3] = value & 0xFF;
+  }
+
+  static bool write_chunk(FILE* f, const char* type, const uint8_t* data,
+                          size_t len) {
+    uint8_t header[8];
+    put_uint32(header, len);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, header + 4, 4);
+    if (len > 0) {
+      crc = crc32(crc, data, len);
+    }
+    uint8_t footer[4];
+    put_uint32(footer, crc);
+    return fwrite(header, 1, 8, f) == 8 &&
+      (len == 0 || fwrite(data, 1, len, f) == len) &&
+      fwrite(footer, 1, 4, f) == 4;
+  }
+};
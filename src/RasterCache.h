@@ -0,0 +1,176 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelOps.h"
+
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+
+/* LRU cache of converted rasters.
+ *
+ * Plots often draw the same raster many times (logos, heatmap facets etc).
+ * Rasters are identified by a 64-bit hash of their content, a second
+ * independent checksum guarding against hash collisions, and their
+ * dimensions. A hit returns the premultiplied BLImage directly so that
+ * conversion and allocation is skipped. The images are owned by Blend2D so
+ * they stay alive while queued in an asynchronous context even if evicted.
+ * The total size of the cached pixels is kept below the given limit.
+ *
+ * Most rasters are only drawn once, so a raster is only admitted to the cache
+ * the second time it is seen. Until then it is merely remembered by a sample
+ * of its pixels, which costs a few dozen reads rather than a pass over the
+ * raster, and the caller converts it into its scratch buffer as usual.
+ */
+class RasterCache {
+  static const size_t MAX_SEEN = 1024;
+  static const size_t N_SAMPLES = 64;
+
+  struct Key {
+    uint64_t hash;
+    uint64_t check;
+    int width;
+    int height;
+    bool operator==(const Key& other) const {
+      return hash == other.hash && check == other.check &&
+        width == other.width && height == other.height;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return k.hash ^ ((uint64_t) k.width << 32) ^ (uint64_t) k.height;
+    }
+  };
+  typedef std::pair<Key, BLImage> Entry;
+
+  std::list<Entry> entries;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  // Samples of rasters seen once, oldest first
+  std::unordered_set<uint64_t> seen;
+  std::deque<uint64_t> seen_order;
+  size_t limit;
+  size_t size = 0;
+
+public:
+  size_t hits = 0;
+  size_t misses = 0;
+
+  RasterCache(size_t limit) : limit(limit) {}
+
+  size_t n_entries() const { return entries.size(); }
+  size_t bytes() const { return size; }
+  size_t max_bytes() const { return limit; }
+
+  /* Sets image to the premultiplied version of raster. Returns false if the
+   * raster is not cached (because the cache is disabled, the raster is larger
+   * than the limit, or it has not been seen before) in which case the caller
+   * must convert it itself.
+   */
+  bool lookup(const uint32_t* raster, int w, int h, BLImage& image) {
+    size_t n = (size_t) w * h;
+    size_t raster_size = n * sizeof(uint32_t);
+    if (raster_size > limit || n == 0) {
+      return false;
+    }
+    uint64_t sample = sample_pixels(raster, w, h);
+    if (seen.find(sample) == seen.end()) {
+      if (seen_order.size() >= MAX_SEEN) {
+        seen.erase(seen_order.front());
+        seen_order.pop_front();
+      }
+      seen.insert(sample);
+      seen_order.push_back(sample);
+      misses++;
+      return false;
+    }
+    Key key = {0, 0, w, h};
+    hash_pixels(raster, n, key.hash, key.check);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      hits++;
+      entries.splice(entries.begin(), entries, it->second);
+      image = it->second->second;
+      return true;
+    }
+    misses++;
+
+    BLImage converted;
+    BLImageData data;
+    if (converted.create(w, h, BL_FORMAT_PRGB32) != BL_SUCCESS ||
+        converted.makeMutable(&data) != BL_SUCCESS) {
+      return false;
+    }
+    uint8_t* pixels = (uint8_t*) data.pixelData;
+    for (int y = 0; y < h; ++y) {
+      premultiply_native((uint32_t*) (pixels + data.stride * y),
+                         raster + (size_t) y * w, w);
+    }
+
+    while (!entries.empty() && size + raster_size > limit) {
+      const Entry& last = entries.back();
+      size -= (size_t) last.first.width * last.first.height * sizeof(uint32_t);
+      index.erase(last.first);
+      entries.pop_back();
+    }
+    entries.push_front(Entry(key, converted));
+    index[key] = entries.begin();
+    size += raster_size;
+
+    image = converted;
+    return true;
+  }
+
+  void clear() {
+    entries.clear();
+    index.clear();
+    seen.clear();
+    seen_order.clear();
+    size = 0;
+  }
+
+private:
+  static uint64_t mix(uint64_t h, uint64_t word) {
+    return (((h << 5) | (h >> 59)) ^ word) * 0x9E3779B97F4A7C15ULL;
+  }
+  static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+  }
+  // Hashes the dimensions and a fixed set of evenly spaced pixels
+  static uint64_t sample_pixels(const uint32_t* pixels, int w, int h) {
+    size_t n = (size_t) w * h;
+    uint64_t hash = mix((uint64_t) w << 32 | (uint32_t) h, n);
+    size_t step = n > N_SAMPLES ? n / N_SAMPLES : 1;
+    for (size_t i = 0; i < n; i += step) {
+      hash = mix(hash, pixels[i]);
+    }
+    return avalanche(mix(hash, pixels[n - 1]));
+  }
+  /* A fast multiply-rotate hash over 64-bit words (similar to FxHash) with a
+   * final avalanche step. check is a Fletcher style sum computed in the same
+   * pass, so a collision would have to happen in both at once
+   */
+  static void hash_pixels(const uint32_t* pixels, size_t n, uint64_t& hash,
+                          uint64_t& check) {
+    uint64_t h = n * 0x9E3779B97F4A7C15ULL;
+    uint64_t a = 1;
+    uint64_t b = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      uint64_t word = (uint64_t) pixels[i] | ((uint64_t) pixels[i + 1] << 32);
+      h = mix(h, word);
+      a += word;
+      b += a;
+    }
+    if (i < n) {
+      h = mix(h, pixels[i]);
+      a += pixels[i];
+      b += a;
+    }
+    hash = avalanche(h);
+    check = a ^ (b << 1);
+  }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "ink.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <textshaping.h>
+
+/* The result of shaping a string with a given font. If shaping failed, shaped
+ * is false and the glyph vectors are empty
+ */
+struct ShapedRun {
+  std::vector<uint32_t> glyphs;
+  std::vector<textshaping::Point> positions;
+  double width = 0.0;
+  bool shaped = false;
+};
+
+/* LRU cache of shaped text runs.
+ *
+ * The graphics engine asks for the width of a string (often many times during
+ * grid layout) before drawing it, and axis labels, legend keys, and strip
+ * texts are repeated across panels and pages. Runs are keyed by the string
+ * together with the font file, face index, and size, so that width queries
+ * and drawing share a single shaping result.
+ */
+class ShapeCache {
+  static const size_t MAX_RUNS = 1024;
+
+  struct Key {
+    std::string text;
+    std::string file;
+    unsigned int index;
+    double size;
+    bool operator==(const Key& other) const {
+      return size == other.size && index == other.index &&
+        text == other.text && file == other.file;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      size_t h = std::hash<std::string>()(k.text);
+      h ^= std::hash<std::string>()(k.file) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      h ^= std::hash<double>()(k.size) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      return h ^ k.index;
+    }
+  };
+  typedef std::pair<Key, ShapedRun> Entry;
+
+  std::list<Entry> entries;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  size_t size = 0;
+  Key lookup_key;
+
+public:
+  size_t hits = 0;
+  size_t misses = 0;
+
+  size_t n_entries() const { return entries.size(); }
+  size_t bytes() const { return size; }
+
+  // Returns the cached run or NULL if the string has not been shaped yet
+  const ShapedRun* find(const char* text, const char* file,
+                        unsigned int face_index, double font_size) {
+    lookup_key.text.assign(text);
+    lookup_key.file.assign(file);
+    lookup_key.index = face_index;
+    lookup_key.size = font_size;
+    auto it = index.find(lookup_key);
+    if (it == index.end()) {
+      misses++;
+      return NULL;
+    }
+    hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->second;
+  }
+
+  // Adds a run for the key of the last call to find(), evicting the least
+  // recently used run if the cache is full
+  const ShapedRun* insert(ShapedRun& run) {
+    while (entries.size() >= MAX_RUNS) {
+      const Entry& last = entries.back();
+      size -= run_size(last);
+      index.erase(last.first);
+      entries.pop_back();
+    }
+    entries.push_front(Entry(lookup_key, ShapedRun()));
+    Entry& entry = entries.front();
+    std::swap(entry.second, run);
+    index[entry.first] = entries.begin();
+    size += run_size(entry);
+    return &entry.second;
+  }
+
+  void clear() {
+    entries.clear();
+    index.clear();
+    size = 0;
+  }
+
+private:
+  static size_t run_size(const Entry& entry) {
+    return entry.first.text.size() + entry.first.file.size() +
+      entry.second.glyphs.size() * sizeof(uint32_t) +
+      entry.second.positions.size() * sizeof(textshaping::Point);
+  }
+};
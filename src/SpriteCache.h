@@ -0,0 +1,204 @@
+#pragma once
+
+#include "ink.h"
+
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+
+enum SpriteShape {
+  SPRITE_CIRCLE = 0,
+  SPRITE_RECT = 1
+};
+
+/* Cache of pre-rasterised point markers.
+ *
+ * Scatter plots draw the same small circle or square thousands of times. Each
+ * marker is rendered once per style and subpixel offset into a small image
+ * which is then stamped onto the canvas with an integer blit. Positions are
+ * snapped to a 1/SUBPIXEL grid, so the error compared to rendering the path
+ * directly is at most 1/(2 * SUBPIXEL) pixel. Sizes and line widths are
+ * rounded to 1/SIZE_STEPS pixel so that markers of varying size (bubble
+ * charts, cex mapped to a variable) still share sprites. Markers larger than
+ * MAX_RADIUS are left to the path renderer. Whether a marker is stamped or
+ * drawn as a path thus only depends on the marker itself, never on what has
+ * been drawn before, so pages and bands render the same regardless of order.
+ *
+ * The least recently used sprites are evicted once MAX_SPRITES are cached.
+ */
+class SpriteCache {
+  struct Key {
+    int shape;
+    int offset_x;
+    int offset_y;
+    int a;   // In 1/SIZE_STEPS pixels
+    int b;
+    int lwd;
+    unsigned int fill;
+    unsigned int col;
+    bool operator==(const Key& other) const {
+      return shape == other.shape && offset_x == other.offset_x &&
+        offset_y == other.offset_y && a == other.a && b == other.b &&
+        lwd == other.lwd && fill == other.fill && col == other.col;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      size_t h = k.shape + (k.offset_x << 4) + (k.offset_y << 8);
+      h = combine(h, k.a);
+      h = combine(h, k.b);
+      h = combine(h, k.lwd);
+      h = combine(h, k.fill);
+      return combine(h, k.col);
+    }
+    static size_t combine(size_t seed, size_t v) {
+      return seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+    }
+  };
+  struct Sprite {
+    BLImage image;
+    int pad;
+  };
+  typedef std::pair<Key, Sprite> Entry;
+
+  std::list<Entry> entries;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+
+public:
+  static const int SUBPIXEL = 4;
+  static const int SIZE_STEPS = 8;
+  static const size_t MAX_SPRITES = 4096;
+  static constexpr double MAX_RADIUS = 16.0;
+
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t size = 0;
+
+  size_t n_entries() const { return entries.size(); }
+
+  /* Find (or render) the sprite for a circle centered at (x, y). fill and col
+   * should be fully transparent if the fill or stroke is not drawn. On success
+   * the sprite and the position to blit it at is returned
+   */
+  bool circle(double x, double y, double r, unsigned int fill,
+              unsigned int col, double lwd, BLImage& image, BLPointI& pos) {
+    double extent = r + (R_ALPHA(col) == 0 ? 0.0 : lwd / 2.0);
+    if (extent > MAX_RADIUS) return false;
+    Key key = make_key(SPRITE_CIRCLE, x, y, r, r, fill, col, lwd, pos);
+    return get(key, image, pos);
+  }
+
+  // Same as circle() but for an axis aligned rectangle with top-left at (x, y)
+  bool rect(double x, double y, double w, double h, unsigned int fill,
+            unsigned int col, double lwd, BLImage& image, BLPointI& pos) {
+    double extent = (w > h ? w : h) / 2.0 +
+      (R_ALPHA(col) == 0 ? 0.0 : lwd / 2.0);
+    if (extent > MAX_RADIUS) return false;
+    Key key = make_key(SPRITE_RECT, x, y, w, h, fill, col, lwd, pos);
+    return get(key, image, pos);
+  }
+
+  void clear() {
+    entries.clear();
+    index.clear();
+    size = 0;
+  }
+
+private:
+  Key make_key(int shape, double x, double y, double a, double b,
+               unsigned int fill, unsigned int col, double lwd,
+               BLPointI& pos) {
+    double qx = std::round(x * SUBPIXEL);
+    double qy = std::round(y * SUBPIXEL);
+    pos.x = (int) std::floor(qx / SUBPIXEL);
+    pos.y = (int) std::floor(qy / SUBPIXEL);
+    Key key;
+    key.shape = shape;
+    key.offset_x = (int) (qx - (double) pos.x * SUBPIXEL);
+    key.offset_y = (int) (qy - (double) pos.y * SUBPIXEL);
+    key.a = (int) std::lround(a * SIZE_STEPS);
+    key.b = (int) std::lround(b * SIZE_STEPS);
+    key.fill = R_ALPHA(fill) == 0 ? 0 : fill;
+    key.col = R_ALPHA(col) == 0 ? 0 : col;
+    key.lwd = key.col == 0 ? 0 : (int) std::lround(lwd * SIZE_STEPS);
+    return key;
+  }
+
+  bool get(const Key& key, BLImage& image, BLPointI& pos) {
+    auto it = index.find(key);
+    const Sprite* found;
+    if (it == index.end()) {
+      misses++;
+      Sprite sprite;
+      if (!render(key, sprite)) {
+        return false;
+      }
+      while (entries.size() >= MAX_SPRITES) {
+        const Sprite& last = entries.back().second;
+        size -= (size_t) last.image.width() * last.image.height() * 4;
+        index.erase(entries.back().first);
+        entries.pop_back();
+      }
+      size += (size_t) sprite.image.width() * sprite.image.height() * 4;
+      entries.push_front(Entry(key, sprite));
+      index[key] = entries.begin();
+      found = &entries.front().second;
+    } else {
+      hits++;
+      entries.splice(entries.begin(), entries, it->second);
+      found = &it->second->second;
+    }
+    image = found->image;
+    pos.x -= found->pad;
+    pos.y -= found->pad;
+    return true;
+  }
+
+  // Renders the marker the same way InkDevice would draw it directly
+  bool render(const Key& key, Sprite& sprite) {
+    double a = (double) key.a / SIZE_STEPS;
+    double b = (double) key.b / SIZE_STEPS;
+    double lwd = (double) key.lwd / SIZE_STEPS;
+    int pad = (int) std::ceil((key.shape == SPRITE_CIRCLE ? a : 0.0) +
+                              lwd / 2.0) + 1;
+    int w = 2 * pad + 2;
+    int h = w;
+    if (key.shape == SPRITE_RECT) {
+      w += (int) std::ceil(a);
+      h += (int) std::ceil(b);
+    }
+    if (sprite.image.create(w, h, BL_FORMAT_PRGB32) != BL_SUCCESS) {
+      return false;
+    }
+    sprite.pad = pad;
+    double x = pad + (double) key.offset_x / SUBPIXEL;
+    double y = pad + (double) key.offset_y / SUBPIXEL;
+
+    BLContext ctx(sprite.image);
+    ctx.setCompOp(BL_COMP_OP_SRC_COPY);
+    ctx.setFillStyle(BLRgba32(0, 0, 0, 0));
+    ctx.fillAll();
+    ctx.setCompOp(BL_COMP_OP_SRC_OVER);
+    ctx.setFillStyle(convert(key.fill));
+    ctx.setStrokeStyle(convert(key.col));
+    ctx.setStrokeWidth(lwd);
+    if (key.shape == SPRITE_CIRCLE) {
+      BLCircle circle(x, y, a);
+      if (key.fill != 0) ctx.fillCircle(circle);
+      if (key.col != 0) ctx.strokeCircle(circle);
+    } else {
+      BLBox box(x, y, x + a, y + b);
+      ctx.setStrokeJoin(BL_STROKE_JOIN_MITER_CLIP);
+      ctx.setStrokeMiterLimit(5);
+      if (key.fill != 0) ctx.fillBox(box);
+      if (key.col != 0) ctx.strokeBox(box);
+    }
+    ctx.end();
+    return true;
+  }
+
+  static BLRgba32 convert(unsigned int col) {
+    return BLRgba32(R_RED(col), R_GREEN(col), R_BLUE(col), R_ALPHA(col));
+  }
+};
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "ink.h"
+#include "ShapeCache.h"
+#include "FontCache.h"
 
+#include <memory>
 #include <vector>
 #include <systemfonts.h>
 #include <textshaping.h>
@@ -14,120 +17,82 @@ class TextRenderer {
   std::vector<unsigned int> font_buffer;
   std::vector<FontSettings> fallback_buffer;
 
-  BLFontData fontdata;
-  BLFontFace fontface;
   BLFont font;
-  BLFontMetrics fontmetrics;
 
-  int last_char = -1;
-  BLGlyphBuffer last_char_buffer;
-  BLTextMetrics last_char_metric;
+  std::shared_ptr<GlyphMetrics> glyph_metrics;
 
 public:
-  TextRenderer() {}
+  ShapeCache shape_cache;
+  // Calls to load_font() reusing the current font or loading another one
+  size_t font_reuses = 0;
+  size_t font_loads = 0;
 
-  BLResult load_font(const char *family, int face, double size) {
-    FontSettings fontfile = get_font_file(family,
-                                      face == 2 || face == 4,
-                                      face == 3 || face == 4,
-                                      face == 5);
+  TextRenderer() {}
 
-    BLResult err = BL_SUCCESS;
+  // Starts counting afresh, e.g. when taken over by a new device
+  void reset_counters() {
+    shape_cache.hits = 0;
+    shape_cache.misses = 0;
+    font_reuses = 0;
+    font_loads = 0;
+  }
 
-    bool refresh = false;
+  BLResult load_font(const char *family, int face, double size) {
+    FontCache& cache = get_font_cache();
+    const FontSettings& fontfile = cache.locate(family, face);
 
-    if (fontfile.index != last_font.index ||
-        strncmp(fontfile.file, last_font.file, PATH_MAX) != 0) {
-      refresh = true;
-      err = fontdata.createFromFile(fontfile.file, BL_FILE_READ_MMAP_ENABLED);
-      if (err != BL_SUCCESS) return err;
+    if (fontfile.index == last_font.index && font.size() == (float) size &&
+        strncmp(fontfile.file, last_font.file, PATH_MAX) == 0) {
+      font_reuses++;
+      return BL_SUCCESS;
     }
-    if (refresh || fontfile.index != last_font.index) {
-      refresh = true;
-      err = fontface.createFromData(fontdata, fontfile.index);
-      if (err != BL_SUCCESS) return err;
+    font_loads++;
+
+    BLResult err = cache.get_font(fontfile, size, font, glyph_metrics);
+    if (err != BL_SUCCESS) {
+      last_font = FontSettings();
+      return err;
     }
     last_font = fontfile;
-    if (refresh || font.size() != (float) size) {
-      refresh = true;
-      err = font.createFromFace(fontface, size);
-      if (err != BL_SUCCESS) return err;
-      fontmetrics = font.metrics();
-    }
-    if (refresh) {
-      last_char = -1;
-      last_char_buffer.clear();
-      last_char_metric.reset();
-    }
 
     return err;
   }
 
   double get_text_width(const char* string) {
-    double width = 0.0;
-    int error = textshaping::string_width(
-      string,
-      last_font,
-      font.size(),
-      72.0,
-      1,
-      &width
-    );
-    if (error) {
-      return 0.0;
-    }
-    return width;
+    return shape(string)->width;
   }
 
   void get_char_metric(int c, double *ascent, double *descent, double *width) {
-    load_char(c);
-    *width = last_char_metric.boundingBox.x1 - last_char_metric.boundingBox.x0;
-    // TODO Use glyph metrics instead of font metrics
-    *ascent = fontmetrics.ascent;
-    *descent = fontmetrics.descent;
+    const GlyphMetric& metric = glyph_metrics->get((uint32_t) c);
+    *width = metric.width;
+    *ascent = metric.ascent;
+    *descent = metric.descent;
   }
 
   void plot_text(double x, double y, const char *string, double rot, double hadj,
                  BLContext &context) {
-    double width = get_text_width(string);
+    const ShapedRun* run = shape(string);
 
-    if (width == 0.0) {
+    if (!run->shaped) {
+      Rf_warning("textshaping failed to shape the string");
       return;
     }
 
-    int expected_max = strlen(string) * 16;
-    loc_buffer.reserve(expected_max);
-    id_buffer.reserve(expected_max);
-    cluster_buffer.reserve(expected_max);
-    font_buffer.reserve(expected_max);
-    fallback_buffer.reserve(expected_max);
-
-    int err = textshaping::string_shape(
-      string,
-      last_font,
-      font.size(),
-      72.0,
-      loc_buffer,
-      id_buffer,
-      cluster_buffer,
-      font_buffer,
-      fallback_buffer
-    );
+    double width = run->width;
 
-    if (err != 0) {
-      Rf_warning("textshaping failed to shape the string");
+    if (width == 0.0) {
       return;
     }
 
-    int n_glyphs = loc_buffer.size();
+    int n_glyphs = run->positions.size();
 
     if (n_glyphs == 0) {
       return;
     }
 
     BLGlyphRun gr = {};
-    gr.glyphData = id_buffer.data();
-    gr.placementData = loc_buffer.data();
+    gr.glyphData = const_cast<uint32_t*>(run->glyphs.data());
+    gr.placementData = const_cast<textshaping::Point*>(run->positions.data());
     gr.size = n_glyphs;
     gr.glyphSize = sizeof(uint32_t);
     gr.glyphAdvance = sizeof(uint32_t);
@@ -150,26 +115,58 @@ public:
   }
 
 private:
-  void load_char(int code) {
-    if (code != last_char) {
-      std::wstring c(static_cast<wchar_t>(code), 1);
-      last_char_buffer.setWCharText(c.c_str(), 1);
-      font.shape(last_char_buffer);
-      font.getTextMetrics(last_char_buffer, last_char_metric);
-
-      last_char = code;
+  /* Shapes the string with the current font, reusing the result of earlier
+   * calls with the same string and font. A miss shapes the string once,
+   * whether it comes from a width query or from drawing. The width is 0 if
+   * the string could not be shaped
+   */
+  const ShapedRun* shape(const char* string) {
+    const ShapedRun* cached = shape_cache.find(string, last_font.file,
+                                               last_font.index, font.size());
+    if (cached != NULL) {
+      return cached;
+    }
+
+    int expected_max = strlen(string) * 16;
+    loc_buffer.reserve(expected_max);
+    id_buffer.reserve(expected_max);
+    cluster_buffer.reserve(expected_max);
+    font_buffer.reserve(expected_max);
+    fallback_buffer.reserve(expected_max);
+
+    ShapedRun run;
+    int error = textshaping::string_shape(
+      string,
+      last_font,
+      font.size(),
+      72.0,
+      loc_buffer,
+      id_buffer,
+      cluster_buffer,
+      font_buffer,
+      fallback_buffer
+    );
+    if (error == 0) {
+      run.shaped = true;
+      run.positions.assign(loc_buffer.begin(), loc_buffer.end());
+      run.glyphs.assign(id_buffer.begin(), id_buffer.end());
+      run.width = run_width(run);
     }
+
+    return shape_cache.insert(run);
   }
-  FontSettings get_font_file(const char* family, int bold, int italic,
-                             int symbol) {
-    const char* fontfamily = family;
-    if (symbol) {
-#if defined _WIN32
-      fontfamily = "Segoe UI Symbol";
-#else
-      fontfamily = "Symbol";
-#endif
+
+  // The width of a shaped run is the position of its last glyph plus the
+  // advance of that glyph in the font it is drawn with
+  double run_width(const ShapedRun& run) {
+    if (run.glyphs.empty()) {
+      return 0.0;
+    }
+    BLGlyphPlacement placement;
+    if (font.getGlyphAdvances(&run.glyphs.back(), sizeof(uint32_t),
+                              &placement, 1) != BL_SUCCESS) {
+      return 0.0;
     }
-    return locate_font_with_features(fontfamily, italic, bold);
+    return run.positions.back().x + placement.advance.x * font.matrix().m00;
   }
 };
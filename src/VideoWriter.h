@@ -0,0 +1,150 @@
+#pragma once
+
+#include "ink.h"
+#include "PixelFormat.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined _WIN32
+#include <io.h>
+#define ink_dup _dup
+#define ink_fdopen _fdopen
+#define ink_popen _popen
+#define ink_pclose _pclose
+#define INK_POPEN_MODE "wb"
+#else
+#include <unistd.h>
+#define ink_dup dup
+#define ink_fdopen fdopen
+#define ink_popen popen
+#define ink_pclose pclose
+#define INK_POPEN_MODE "w"
+#endif
+
+enum VideoFormat {
+  VIDEO_Y4M = 0,
+  VIDEO_RGBA = 1
+};
+
+/* Writer appending pages as frames to a single uncompressed video stream.
+ *
+ * The stream can be a file, the standard input of a command (given as a
+ * target starting with '|'), or an already open file descriptor, so that an
+ * encoder such as ffmpeg can consume the frames as they are produced. Frames
+ * are written either as YUV4MPEG2 (4:2:0, BT.601) or as raw non-premultiplied
+ * RGBA without any header. Each frame is converted into a buffer that is kept
+ * between frames and written with a single call, so the per-frame cost is a
+ * pixel conversion and a write.
+ *
+ * The writer is not thread safe, but may be used from another thread than the
+ * one creating it.
+ */
+class VideoWriter {
+  int format;
+  int fps_num;
+  int fps_den;
+
+  FILE* stream = NULL;
+  bool is_pipe = false;
+  bool header_written = false;
+  std::vector<uint8_t> frame;
+
+public:
+  VideoWriter(int format, double fps) :
+    format(format)
+  {
+    // Non-integer rates are given in thousandths
+    if (fps == (int) fps) {
+      fps_num = (int) fps;
+      fps_den = 1;
+    } else {
+      fps_num = (int) (fps * 1000 + 0.5);
+      fps_den = 1000;
+    }
+  }
+  ~VideoWriter() {
+    close();
+  }
+
+  // Opens a file, or a command to pipe to if target starts with '|'
+  bool open(const char* target) {
+    if (target[0] == '|') {
+      stream = ink_popen(target + 1, INK_POPEN_MODE);
+      is_pipe = true;
+    } else {
+      stream = fopen(target, "wb");
+    }
+    return stream != NULL;
+  }
+  // Writes to a duplicate of the file descriptor, leaving the original open
+  bool open(int fd) {
+    int dup_fd = ink_dup(fd);
+    if (dup_fd < 0) return false;
+    stream = ink_fdopen(dup_fd, "wb");
+    return stream != NULL;
+  }
+
+  bool write(const BLImage& image) {
+    if (stream == NULL) return false;
+    BLImageData data;
+    if (image.getData(&data) != BL_SUCCESS) {
+      return false;
+    }
+    int w = data.size.w;
+    int h = data.size.h;
+    const uint8_t* pixels = (const uint8_t*) data.pixelData;
+
+    if (format == VIDEO_RGBA) {
+      frame.resize(4 * (size_t) w * h);
+      if (data.format == BL_FORMAT_XRGB32) {
+        to_rgba<BL_FORMAT_XRGB32>(data);
+      } else {
+        to_rgba<BL_FORMAT_PRGB32>(data);
+      }
+      return fwrite(frame.data(), 1, frame.size(), stream) == frame.size();
+    }
+
+    if (!header_written) {
+      if (fprintf(stream, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n", w, h,
+                  fps_num, fps_den) < 0) {
+        return false;
+      }
+      header_written = true;
+    }
+    static const char tag[] = "FRAME\n";
+    const size_t tag_size = sizeof(tag) - 1;
+    size_t luma_size = (size_t) w * h;
+    size_t chroma_size = (size_t) ((w + 1) / 2) * ((h + 1) / 2);
+    frame.resize(tag_size + luma_size + 2 * chroma_size);
+    memcpy(frame.data(), tag, tag_size);
+    uint8_t* y_plane = frame.data() + tag_size;
+    uint8_t* u_plane = y_plane + luma_size;
+    uint8_t* v_plane = u_plane + chroma_size;
+    prgb_to_yuv420(y_plane, u_plane, v_plane, pixels, data.stride, w, h);
+    return fwrite(frame.data(), 1, frame.size(), stream) == frame.size();
+  }
+
+  // Flushes and closes the stream. For commands this waits for them to exit
+  bool close() {
+    if (stream == NULL) return true;
+    bool success = is_pipe ? ink_pclose(stream) == 0 : fclose(stream) == 0;
+    stream = NULL;
+    return success;
+  }
+
+private:
+  // Converts the image into the frame buffer as non-premultiplied RGBA
+  template<uint32_t Format>
+  void to_rgba(const BLImageData& data) {
+    const uint8_t* pixels = (const uint8_t*) data.pixelData;
+    uint32_t* dest = (uint32_t*) frame.data();
+    for (int y = 0; y < data.size.h; ++y) {
+      PixelFormat<Format>::to_native(
+        dest + (size_t) data.size.w * y,
+        (const uint32_t*) (pixels + data.stride * y), data.size.w
+      );
+    }
+  }
+};
@@ -0,0 +1,167 @@
+#include "ink.h"
+#include "InkDevice.h"
+
+/* Fetches the InkDevice for a device number as given by dev.cur(). The R side
+ * is responsible for checking that the device is an ink device
+ */
+InkDevice* get_ink_device(SEXP which) {
+  pGEDevDesc gd = GEgetDevice(INTEGER(which)[0] - 1);
+  if (gd == NULL || gd->dev == NULL || gd->dev->deviceSpecific == NULL) {
+    Rf_error("ink device is not open");
+  }
+  return (InkDevice*) gd->dev->deviceSpecific;
+}
+
+// [[export]]
+SEXP ink_cache_info_c(SEXP which) {
+  InkDevice* device = get_ink_device(which);
+  const char* caches[] = {"raster", "sprite", "text", "font", "pool"};
+  const RasterCache& raster = device->raster_cache;
+  const SpriteCache& sprite = device->sprite_cache;
+  const ShapeCache& text = device->text_renderer.shape_cache;
+  // Shared by all devices
+  const FontCache& font = get_font_cache();
+  const DevicePool& pool = get_device_pool();
+  double hits[] = {(double) raster.hits, (double) sprite.hits,
+                   (double) text.hits, (double) font.hits,
+                   (double) pool.hits};
+  double misses[] = {(double) raster.misses, (double) sprite.misses,
+                     (double) text.misses, (double) font.misses,
+                     (double) pool.misses};
+  double entries[] = {(double) raster.n_entries(),
+                      (double) sprite.n_entries(),
+                      (double) text.n_entries(), (double) font.n_entries(),
+                      (double) pool.n_entries()};
+  double bytes[] = {(double) raster.bytes(), (double) sprite.size,
+                    (double) text.bytes(), NA_REAL, (double) pool.bytes()};
+  double limit[] = {(double) raster.max_bytes(), NA_REAL, NA_REAL, NA_REAL,
+                    (double) pool.limit()};
+  int n = sizeof(caches) / sizeof(caches[0]);
+
+  const char* names[] = {"cache", "hits", "misses", "entries", "size", "limit"};
+  SEXP info = PROTECT(Rf_allocVector(VECSXP, 6));
+  SEXP info_names = PROTECT(Rf_allocVector(STRSXP, 6));
+  SEXP cache_col = PROTECT(Rf_allocVector(STRSXP, n));
+  double* cols[] = {hits, misses, entries, bytes, limit};
+  for (int i = 0; i < n; ++i) {
+    SET_STRING_ELT(cache_col, i, Rf_mkChar(caches[i]));
+  }
+  SET_VECTOR_ELT(info, 0, cache_col);
+  for (int j = 0; j < 5; ++j) {
+    SEXP col = Rf_allocVector(REALSXP, n);
+    SET_VECTOR_ELT(info, j + 1, col);
+    for (int i = 0; i < n; ++i) {
+      REAL(col)[i] = cols[j][i];
+    }
+  }
+  for (int j = 0; j < 6; ++j) {
+    SET_STRING_ELT(info_names, j, Rf_mkChar(names[j]));
+  }
+  Rf_setAttrib(info, R_NamesSymbol, info_names);
+  UNPROTECT(3);
+  return info;
+}
+
+// Creates a named list of equal length columns to be turned into a data.frame
+static SEXP stats_table(const char* label, const char* const* rows, int n,
+                        const char* const* names, const double* const* cols,
+                        int n_cols) {
+  SEXP table = PROTECT(Rf_allocVector(VECSXP, n_cols + 1));
+  SEXP table_names = PROTECT(Rf_allocVector(STRSXP, n_cols + 1));
+  SEXP row_col = Rf_allocVector(STRSXP, n);
+  SET_VECTOR_ELT(table, 0, row_col);
+  SET_STRING_ELT(table_names, 0, Rf_mkChar(label));
+  for (int i = 0; i < n; ++i) {
+    SET_STRING_ELT(row_col, i, Rf_mkChar(rows[i]));
+  }
+  for (int j = 0; j < n_cols; ++j) {
+    SEXP col = Rf_allocVector(REALSXP, n);
+    SET_VECTOR_ELT(table, j + 1, col);
+    SET_STRING_ELT(table_names, j + 1, Rf_mkChar(names[j]));
+    for (int i = 0; i < n; ++i) {
+      REAL(col)[i] = cols[j][i];
+    }
+  }
+  Rf_setAttrib(table, R_NamesSymbol, table_names);
+  UNPROTECT(2);
+  return table;
+}
+
+// [[export]]
+SEXP ink_stats_c(SEXP which, SEXP timeline, SEXP reset) {
+  InkDevice* device = get_ink_device(which);
+  DeviceStats* stats = device->stats.get();
+  if (stats == NULL) {
+    Rf_error("The device is not collecting stats. Open it with `stats = TRUE`");
+  }
+  if (!Rf_isNull(timeline) &&
+      !stats->write_timeline(CHAR(STRING_ELT(timeline, 0)))) {
+    Rf_error("ink could not write the timeline");
+  }
+
+  double call_count[OP_N], call_time[OP_N];
+  for (int i = 0; i < OP_N; ++i) {
+    call_count[i] = stats->calls[i].count;
+    call_time[i] = stats->calls[i].time;
+  }
+  // Font loads are counted by the text renderer regardless of stats
+  const TextRenderer& text = device->text_renderer;
+  const char* states[STATE_N + 1];
+  double hits[STATE_N + 1], misses[STATE_N + 1];
+  for (int i = 0; i < STATE_N; ++i) {
+    states[i] = state_cache_names[i];
+    hits[i] = stats->state_hits[i];
+    misses[i] = stats->state_misses[i];
+  }
+  states[STATE_N] = "font";
+  hits[STATE_N] = text.font_reuses;
+  misses[STATE_N] = text.font_loads;
+  double phase_count[PHASE_N], phase_time[PHASE_N];
+  for (int i = 0; i < PHASE_N; ++i) {
+    phase_count[i] = stats->phases[i].count;
+    phase_time[i] = stats->phases[i].time;
+  }
+
+  const char* count_names[] = {"count", "time"};
+  const double* call_cols[] = {call_count, call_time};
+  const char* state_names[] = {"hits", "misses"};
+  const double* state_cols[] = {hits, misses};
+  const double* phase_cols[] = {phase_count, phase_time};
+
+  SEXP info = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(info, 0, stats_table("call", device_op_names, OP_N,
+                                      count_names, call_cols, 2));
+  SET_VECTOR_ELT(info, 1, stats_table("cache", states, STATE_N + 1,
+                                      state_names, state_cols, 2));
+  SET_VECTOR_ELT(info, 2, stats_table("phase", page_phase_names, PHASE_N,
+                                      count_names, phase_cols, 2));
+  SEXP info_names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_STRING_ELT(info_names, 0, Rf_mkChar("calls"));
+  SET_STRING_ELT(info_names, 1, Rf_mkChar("state"));
+  SET_STRING_ELT(info_names, 2, Rf_mkChar("pages"));
+  Rf_setAttrib(info, R_NamesSymbol, info_names);
+
+  if (Rf_asLogical(reset)) {
+    stats->reset();
+    device->text_renderer.font_reuses = 0;
+    device->text_renderer.font_loads = 0;
+  }
+  UNPROTECT(2);
+  return info;
+}
+
+// [[export]]
+SEXP ink_pool_limit_c(SEXP limit) {
+  DevicePool& pool = get_device_pool();
+  double old_limit = pool.limit();
+  if (!Rf_isNull(limit)) {
+    pool.set_limit((size_t) Rf_asReal(limit));
+  }
+  return Rf_ScalarReal(old_limit);
+}
+
+// [[export]]
+SEXP ink_pool_flush_c() {
+  get_device_pool().flush();
+  return R_NilValue;
+}
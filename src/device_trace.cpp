@@ -0,0 +1,31 @@
+#include "ink.h"
+#include "InkDevice.h"
+
+// [[export]]
+SEXP ink_trace_c(SEXP file, SEXP which) {
+  InkDevice* device = get_ink_device(which);
+  if (device->trace) {
+    bool success = device->trace->finish();
+    device->trace.reset();
+    if (!success) {
+      Rf_warning("ink could not write the device trace");
+    }
+  }
+  if (Rf_isNull(file)) {
+    return R_NilValue;
+  }
+  TraceHeader header;
+  header.width = device->width;
+  header.height = device->height;
+  header.pointsize = device->pointsize;
+  header.background = device->background_int;
+  header.res = device->res_real;
+  header.scaling = device->res_mod * 72.0 / device->res_real;
+  DeviceTrace* trace = new DeviceTrace();
+  if (!trace->open(CHAR(STRING_ELT(file, 0)), header)) {
+    delete trace;
+    Rf_error("ink could not open the trace file for writing");
+  }
+  device->trace.reset(trace);
+  return R_NilValue;
+}
@@ -0,0 +1,35 @@
+#include "ink.h"
+#include "InkDevice.h"
+
+static void finalize_recording(SEXP recording) {
+  DisplayList* list = (DisplayList*) R_ExternalPtrAddr(recording);
+  if (list != NULL) {
+    delete list;
+    R_ClearExternalPtr(recording);
+  }
+}
+
+// [[export]]
+SEXP ink_record_c(SEXP which) {
+  InkDevice* device = get_ink_device(which);
+  if (!device->recording) {
+    Rf_error("The device is not recording. Open it with `record = TRUE`");
+  }
+  DisplayList* list = new DisplayList(device->display_list);
+  SEXP recording = PROTECT(R_MakeExternalPtr(list, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(recording, finalize_recording, TRUE);
+  Rf_setAttrib(recording, R_ClassSymbol, Rf_mkString("ink_recording"));
+  UNPROTECT(1);
+  return recording;
+}
+
+// [[export]]
+SEXP ink_replay_c(SEXP recording, SEXP which) {
+  DisplayList* list = (DisplayList*) R_ExternalPtrAddr(recording);
+  if (list == NULL) {
+    Rf_error("The recording is no longer available");
+  }
+  InkDevice* device = get_ink_device(which);
+  device->replay(*list);
+  return R_NilValue;
+}
@@ -4,25 +4,45 @@
 #include <R_ext/Rdynload.h>
 
 #include "ink.h"
+#include "FontCache.h"
+#include "DevicePool.h"
 
-static font_map* fonts;
+static FontCache* fonts;
+static DevicePool* pool;
 
-font_map& get_font_map(){
+FontCache& get_font_cache(){
   return *fonts;
 }
 
+DevicePool& get_device_pool(){
+  return *pool;
+}
+
 static const R_CallMethodDef CallEntries[] = {
-  {"ink_bmp_c", (DL_FUNC) &ink_bmp_c, 7},
+  {"ink_bmp_c", (DL_FUNC) &ink_bmp_c, 8},
+  {"ink_png_c", (DL_FUNC) &ink_png_c, 11},
+  {"ink_video_c", (DL_FUNC) &ink_video_c, 10},
+  {"ink_shm_c", (DL_FUNC) &ink_shm_c, 9},
+  {"ink_shm_read_c", (DL_FUNC) &ink_shm_read_c, 1},
+  {"ink_cache_info_c", (DL_FUNC) &ink_cache_info_c, 1},
+  {"ink_stats_c", (DL_FUNC) &ink_stats_c, 3},
+  {"ink_pool_limit_c", (DL_FUNC) &ink_pool_limit_c, 1},
+  {"ink_pool_flush_c", (DL_FUNC) &ink_pool_flush_c, 0},
+  {"ink_record_c", (DL_FUNC) &ink_record_c, 1},
+  {"ink_replay_c", (DL_FUNC) &ink_replay_c, 2},
+  {"ink_trace_c", (DL_FUNC) &ink_trace_c, 2},
   {NULL, NULL, 0}
 };
 
 extern "C" void R_init_ink(DllInfo *dll) {
-  fonts = new font_map();
+  fonts = new FontCache();
+  pool = new DevicePool(32 * 1024 * 1024);
 
   R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
 }
 
 extern "C" void R_unload_ink(DllInfo *dll) {
+  delete pool;
   delete fonts;
 }
@@ -6,6 +6,11 @@ template<class T>
 void ink_metric_info(int c, const pGEcontext gc, double* ascent,
                      double* descent, double* width, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_METRIC_INFO, device->pageno);
+  if (device->trace) {
+    device->trace->record().metric_info(c, gc->fontfamily, gc->fontface,
+                                        gc->ps * gc->cex);
+  }
   device->charMetric(c, gc->fontfamily, gc->fontface, gc->ps * gc->cex,
                      ascent, descent, width);
   return;
@@ -14,12 +19,16 @@ void ink_metric_info(int c, const pGEcontext gc, double* ascent,
 template<class T>
 void ink_clip(double x0, double x1, double y0, double y1, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_CLIP, device->pageno);
+  if (device->trace) device->trace->record().clip(x0, y0, x1, y1);
   device->clipRect(x0, y0, x1, y1);
 }
 
 template<class T>
 void ink_new_page(const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_NEW_PAGE, device->pageno);
+  if (device->trace) device->trace->record().page(gc->fill);
   device->newPage(gc->fill);
   return;
 }
@@ -27,6 +36,12 @@ void ink_new_page(const pGEcontext gc, pDevDesc dd) {
 template<class T>
 void ink_close(pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  if (device->trace) {
+    device->trace->record().close();
+    if (!device->trace->finish()) {
+      Rf_warning("ink could not write the device trace");
+    }
+  }
   device->close();
   delete device;
   return;
@@ -36,6 +51,11 @@ template<class T>
 void ink_line(double x1, double y1, double x2, double y2,
               const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_LINE, device->pageno);
+  if (device->trace) {
+    device->trace->record().line(x1, y1, x2, y2, gc->col, gc->lwd, gc->lty,
+                                 gc->lend);
+  }
   device->drawLine(x1, y1, x2, y2, gc->col, gc->lwd, gc->lty, gc->lend);
   return;
 }
@@ -44,6 +64,11 @@ template<class T>
 void ink_polyline(int n, double *x, double *y, const pGEcontext gc,
                   pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_POLYLINE, device->pageno);
+  if (device->trace) {
+    device->trace->record().polyline(n, x, y, gc->col, gc->lwd, gc->lty,
+                                     gc->lend, gc->ljoin, gc->lmitre);
+  }
   device->drawPolyline(n, x, y, gc->col, gc->lwd, gc->lty, gc->lend, gc->ljoin,
                        gc->lmitre);
   return;
@@ -53,6 +78,11 @@ template<class T>
 void ink_polygon(int n, double *x, double *y, const pGEcontext gc,
                  pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_POLYGON, device->pageno);
+  if (device->trace) {
+    device->trace->record().polygon(n, x, y, gc->fill, gc->col, gc->lwd,
+                                    gc->lty, gc->lend, gc->ljoin, gc->lmitre);
+  }
   device->drawPolygon(n, x, y, gc->fill, gc->col, gc->lwd, gc->lty, gc->lend,
                       gc->ljoin, gc->lmitre);
   return;
@@ -62,6 +92,12 @@ template<class T>
 void ink_path(double *x, double *y, int npoly, int *nper, Rboolean winding,
               const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_PATH, device->pageno);
+  if (device->trace) {
+    device->trace->record().path(npoly, nper, x, y, gc->col, gc->fill,
+                                 gc->lwd, gc->lty, gc->lend, gc->ljoin,
+                                 gc->lmitre, !winding);
+  }
   device->drawPath(npoly, nper, x, y, gc->col, gc->fill, gc->lwd, gc->lty,
                    gc->lend, gc->ljoin, gc->lmitre, !winding);
   return;
@@ -70,6 +106,11 @@ void ink_path(double *x, double *y, int npoly, int *nper, Rboolean winding,
 template<class T>
 double ink_strwidth(const char *str, const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_STR_WIDTH, device->pageno);
+  if (device->trace) {
+    device->trace->record().str_width(str, gc->fontfamily, gc->fontface,
+                                      gc->ps * gc->cex);
+  }
   return device->stringWidth(str, gc->fontfamily, gc->fontface,
                              gc->ps * gc->cex);
 }
@@ -78,6 +119,11 @@ template<class T>
 void ink_rect(double x0, double y0, double x1, double y1, const pGEcontext gc,
               pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_RECT, device->pageno);
+  if (device->trace) {
+    device->trace->record().rect(x0, y0, x1, y1, gc->fill, gc->col, gc->lwd,
+                                 gc->lty, gc->lend);
+  }
   device->drawRect(x0, y0, x1, y1, gc->fill, gc->col, gc->lwd,
                    gc->lty, gc->lend);
   return;
@@ -87,6 +133,11 @@ template<class T>
 void ink_circle(double x, double y, double r, const pGEcontext gc,
                 pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_CIRCLE, device->pageno);
+  if (device->trace) {
+    device->trace->record().circle(x, y, r, gc->fill, gc->col, gc->lwd, gc->lty,
+                                   gc->lend);
+  }
   device->drawCircle(x, y, r, gc->fill, gc->col, gc->lwd, gc->lty, gc->lend);
   return;
 }
@@ -95,6 +146,11 @@ template<class T>
 void ink_text(double x, double y, const char *str, double rot, double hadj,
               const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_TEXT, device->pageno);
+  if (device->trace) {
+    device->trace->record().text(x, y, str, gc->fontfamily, gc->fontface,
+                                 gc->ps * gc->cex, rot, hadj, gc->col);
+  }
   device->drawText(x, y, str, gc->fontfamily, gc->fontface, gc->ps * gc->cex,
                    rot, hadj, gc->col);
   return;
@@ -113,6 +169,11 @@ void ink_raster(unsigned int *raster, int w, int h, double x, double y,
                 double width, double height, double rot, Rboolean interpolate,
                 const pGEcontext gc, pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_RASTER, device->pageno);
+  if (device->trace) {
+    device->trace->record().raster(raster, w, h, x, y, width, height, rot,
+                                   interpolate);
+  }
   device->drawRaster(raster, w, h, x, y, width, height, rot, interpolate);
   return;
 }
@@ -120,9 +181,48 @@ void ink_raster(unsigned int *raster, int w, int h, double x, double y,
 template<class T>
 SEXP ink_capture(pDevDesc dd) {
   T * device = (T *) dd->deviceSpecific;
+  CallTimer timer(device->stats.get(), OP_CAPTURE, device->pageno);
+  if (device->trace) device->trace->record().capture();
   return device->capture();
 }
 
+/* Reads the performance settings from the named list created by
+ * device_options() in R. Missing elements keep their default
+ */
+inline InkOptions read_options(SEXP options) {
+  InkOptions opts;
+  SEXP names = Rf_getAttrib(options, R_NamesSymbol);
+  for (int i = 0; i < Rf_length(options); ++i) {
+    const char* name = CHAR(STRING_ELT(names, i));
+    SEXP value = VECTOR_ELT(options, i);
+    if (strcmp(name, "threads") == 0) {
+      opts.threads = Rf_asInteger(value);
+    } else if (strcmp(name, "async") == 0) {
+      opts.async = Rf_asInteger(value);
+    } else if (strcmp(name, "raster_cache") == 0) {
+      opts.raster_cache = (size_t) Rf_asReal(value);
+    } else if (strcmp(name, "sprites") == 0) {
+      opts.sprites = Rf_asLogical(value);
+    } else if (strcmp(name, "decimate") == 0) {
+      opts.decimate = Rf_asLogical(value);
+    } else if (strcmp(name, "snap") == 0) {
+      opts.snap = Rf_asLogical(value);
+    } else if (strcmp(name, "record") == 0) {
+      opts.record = Rf_asLogical(value);
+    } else if (strcmp(name, "band") == 0) {
+      opts.band = Rf_asInteger(value);
+    } else if (strcmp(name, "mmap") == 0) {
+      opts.mmap = Rf_asLogical(value);
+    } else if (strcmp(name, "stats") == 0) {
+      opts.stats = Rf_asLogical(value);
+    } else if (strcmp(name, "opaque") == 0) {
+      int opaque = Rf_asLogical(value);
+      opts.opaque = opaque == NA_LOGICAL ? -1 : opaque;
+    }
+  }
+  return opts;
+}
+
 template<class T>
 pDevDesc ink_device_new(T* device) {
 
@@ -156,8 +256,10 @@ pDevDesc ink_device_new(T* device) {
   dd->metricInfo = ink_metric_info<T>;
   if (device->can_capture) {
     dd->cap = ink_capture<T>;
+    dd->haveCapture = 2;
   } else {
     dd->cap = NULL;
+    dd->haveCapture = 1;
   }
   dd->raster = ink_raster<T>;
 
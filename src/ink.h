@@ -1,9 +1,6 @@
 #pragma once
 
 #include <string>
-#include <tuple>
-#include <utility>
-#include <unordered_map>
 
 #include <R.h>
 #include <Rinternals.h>
@@ -13,29 +10,37 @@
 
 const double DEG_TO_RAD = 0.0174533;
 
-typedef std::tuple<std::string, int, int> font_key;
-
-struct key_hash : public std::unary_function<font_key, std::size_t>
-{
-  inline std::size_t operator()(const font_key& k) const
-  {
-    return std::get<0>(k)[0] ^ std::get<1>(k) ^ std::get<2>(k);
-  }
-};
-
-struct key_equal : public std::binary_function<font_key, font_key, bool>
-{
-  inline bool operator()(const font_key& v0, const font_key& v1) const
-  {
-    return (
-        std::get<0>(v0) == std::get<0>(v1) &&
-          std::get<1>(v0) == std::get<1>(v1) &&
-          std::get<2>(v0) == std::get<2>(v1)
-    );
-  }
+/* Performance settings shared by all ink devices. These are passed from R as a
+ * named list and documented with the device functions
+ */
+struct InkOptions {
+  int threads = 0;
+  int async = 0;
+  size_t raster_cache = 0;
+  bool sprites = false;
+  bool decimate = false;
+  bool snap = false;
+  bool record = false;
+  int band = 0;
+  bool mmap = false;
+  bool stats = false;
+  int opaque = -1; // -1: if the background is opaque
 };
 
-typedef std::unordered_map<font_key, std::pair< std::string, int >, key_hash, key_equal> font_map;
-
 SEXP ink_bmp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
-               SEXP res, SEXP scaling);
+               SEXP res, SEXP scaling, SEXP options);
+SEXP ink_png_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP options, SEXP compression,
+               SEXP filter, SEXP deflate_threads);
+SEXP ink_video_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+                 SEXP res, SEXP scaling, SEXP options, SEXP format, SEXP fps);
+SEXP ink_shm_c(SEXP name, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP options, SEXP slots);
+SEXP ink_shm_read_c(SEXP name);
+SEXP ink_cache_info_c(SEXP which);
+SEXP ink_stats_c(SEXP which, SEXP timeline, SEXP reset);
+SEXP ink_pool_limit_c(SEXP limit);
+SEXP ink_pool_flush_c();
+SEXP ink_record_c(SEXP which);
+SEXP ink_replay_c(SEXP recording, SEXP which);
+SEXP ink_trace_c(SEXP file, SEXP which);
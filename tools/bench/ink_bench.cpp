@@ -0,0 +1,221 @@
+/* Standalone replay benchmark for ink device traces.
+ *
+ * Replays a trace recorded with ink_trace() directly against the InkDevice
+ * drawing methods, without an R session or the graphics engine, and reports
+ * the time spent in each kind of call:
+ *
+ *   ink_bench [options] plot.inktrace
+ *
+ *   --repeat N     Replay the trace N times (default 1)
+ *   --threads N    Rasterise with N worker threads
+ *   --sprites      Stamp point markers from the sprite cache
+ *   --decimate     Decimate long solid lines and unfilled paths
+ *   --snap         Snap rectangles to pixel boundaries
+ *   --output FILE  Write the pages as BMP files (sprintf pattern taking the
+ *                  page number). By default pages are rendered but discarded
+ *
+ * Text is shaped and rendered through systemfonts and textshaping, which are
+ * only reachable from within a running R session. Text calls (text, strWidth,
+ * metricInfo) are therefore counted but not replayed, as are captures.
+ *
+ * Calls are timed individually. Shapes may be batched and drawn by a later
+ * call, and with worker threads the rasterisation of all calls on a page
+ * happens when the page is finished, so the cost of those is attributed to
+ * the call flushing them (usually newPage or close).
+ */
+
+#include "InkDevice.h"
+#include "BmpWriter.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+class BenchDevice : public InkDevice {
+  BmpWriter writer;
+
+public:
+  BenchDevice(const char* fp, const TraceHeader& header,
+              const InkOptions& options) :
+  InkDevice(fp, header.width, header.height, header.pointsize,
+            header.background, header.res, header.scaling, options),
+  writer(header.res)
+  {
+
+  }
+  bool writePage(const BLImage& image, int page) {
+    if (file.empty()) return true;
+    char buf[PATH_MAX+1];
+    snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+    return writer.write(image, buf);
+  }
+
+  // Calls that need R are hidden so they are never compiled in
+  void drawText(double x, double y, const char *str, const char *family,
+                int face, double size, double rot, double hadj, int col) {}
+  double stringWidth(const char *str, const char *family, int face,
+                     double size) {
+    return 0.0;
+  }
+  void charMetric(int c, const char *family, int face, double size,
+                  double *ascent, double *descent, double *width) {
+    *ascent = 0.0;
+    *descent = 0.0;
+    *width = 0.0;
+  }
+  SEXP capture() {
+    return NULL;
+  }
+};
+
+struct OpTiming {
+  long calls = 0;
+  double total = 0.0;
+  double max = 0.0;
+};
+
+static bool is_skipped(DeviceOp op) {
+  return op == OP_TEXT || op == OP_STR_WIDTH ||
+    op == OP_METRIC_INFO || op == OP_CAPTURE;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: ink_bench [--repeat N] [--threads N] "
+          "[--sprites] [--decimate] [--snap] [--output FILE] TRACE\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  InkOptions options;
+  options.raster_cache = 32 * 1024 * 1024;
+  int repeat = 1;
+  const char* output = "";
+  const char* path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      options.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sprites") == 0) {
+      options.sprites = true;
+    } else if (strcmp(argv[i], "--decimate") == 0) {
+      options.decimate = true;
+    } else if (strcmp(argv[i], "--snap") == 0) {
+      options.snap = true;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL || repeat < 1) usage();
+
+  TraceReader reader;
+  if (!reader.open(path)) {
+    fprintf(stderr, "ink_bench: %s is not a readable ink trace\n", path);
+    return 1;
+  }
+  const TraceHeader& header = reader.header;
+
+  typedef std::chrono::steady_clock clock;
+  OpTiming timings[OP_N];
+  OpCall call;
+  bool truncated = false;
+  clock::time_point start = clock::now();
+  for (int run = 0; run < repeat; ++run) {
+    reader.rewind();
+    BenchDevice device(output, header, options);
+    bool closed = false;
+    while (reader.next(call)) {
+      OpTiming& timing = timings[call.op];
+      clock::time_point before = clock::now();
+      op_apply(device, call);
+      double elapsed = std::chrono::duration<double>(clock::now() - before)
+        .count();
+      timing.calls++;
+      timing.total += elapsed;
+      timing.max = elapsed > timing.max ? elapsed : timing.max;
+      if (call.op == OP_CLOSE) {
+        closed = true;
+        break;
+      }
+    }
+    truncated = truncated || !closed;
+    // Traces stopped before the device was closed still finish the last page
+    if (!closed) {
+      OpTiming& timing = timings[OP_CLOSE];
+      clock::time_point before = clock::now();
+      device.close();
+      double elapsed = std::chrono::duration<double>(clock::now() - before)
+        .count();
+      timing.calls++;
+      timing.total += elapsed;
+      timing.max = elapsed > timing.max ? elapsed : timing.max;
+    }
+  }
+  double wall = std::chrono::duration<double>(clock::now() - start).count();
+
+  double total = 0.0;
+  for (int i = 0; i < OP_N; ++i) total += timings[i].total;
+
+  printf("trace: %s (%dx%d px, %g dpi)\n", path, header.width, header.height,
+         header.res);
+  if (truncated) {
+    printf("note: the trace does not end with close, the last page was "
+           "finished by the benchmark\n");
+  }
+  printf("%-12s %10s %12s %12s %12s %7s\n", "call", "calls", "total ms",
+         "mean us", "max us", "share");
+  for (int i = 0; i < OP_N; ++i) {
+    const OpTiming& timing = timings[i];
+    if (timing.calls == 0) continue;
+    if (is_skipped((DeviceOp) i)) {
+      printf("%-12s %10ld %12s %12s %12s %7s\n", device_op_names[i],
+             timing.calls / repeat, "skipped", "", "", "");
+      continue;
+    }
+    printf("%-12s %10ld %12.3f %12.3f %12.3f %6.1f%%\n", device_op_names[i],
+           timing.calls / repeat, 1e3 * timing.total / repeat,
+           1e6 * timing.total / timing.calls, 1e6 * timing.max,
+           total > 0 ? 100.0 * timing.total / total : 0.0);
+  }
+  printf("total: %.3f ms per replay (%.3f ms including trace decoding, %d "
+         "replays)\n", 1e3 * total / repeat, 1e3 * wall / repeat, repeat);
+  return 0;
+}
+
+// R API stand-ins ------------------------------------------------------------
+
+void Rf_warning(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "ink_bench warning: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+// Only used for the initial pen and fill colour of the device
+unsigned int R_GE_str2col(const char* s) {
+  return R_RGB(0, 0, 0);
+}
+
+// Text is never drawn (see above) but the font lookup is still compiled in as
+// part of banded rendering
+DL_FUNC R_GetCCallable(const char* package, const char* name) {
+  return NULL;
+}
+FontCache& get_font_cache() {
+  static FontCache cache;
+  return cache;
+}
+// Pooling is disabled so every replay starts from a fresh device
+DevicePool& get_device_pool() {
+  static DevicePool pool(0);
+  return pool;
+}